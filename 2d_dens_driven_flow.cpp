@@ -1,4 +1,9 @@
 #include "inmost.h"
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <map>
 
 //    !!!!!!! Currently NOT suited for parallel run
 //
@@ -33,7 +38,8 @@ enum{
     T_PRECOND,
     T_IO,
     T_INIT,
-    T_UPDATE
+    T_UPDATE,
+    T_ADAPT
 };
 
 const string tagNameTensorK  = "HYDRAULIC_CONDUCTIVITY";
@@ -44,21 +50,158 @@ const string tagNameHead     = "Water_Head";
 const string tagNameConc     = "Conc";
 const string tagNameHeadPrev = "Water_Head_Prev";
 const string tagNameConcPrev = "Conc_Prev";
+const string tagNameHeadPrev2 = "Water_Head_Prev2";
+const string tagNameConcPrev2 = "Conc_Prev2";
 const string tagNameWatFlux  = "Water_Flux";
+const string tagNameDarcy    = "Darcy_Flux";
+const string tagNameAMRHist  = "AMR_HISTORY";
+
+// Time stepping, final time and dt bounds can be set from command line
+double       dt              = 1e-3; // current time step, changed by the controller
+double       Tfinal          = 25e-3;
+double       dtMin           = 1e-6;
+double       dtMax           = 1e-2;
+const int    nwtMaxIt        = 20;   // Newton iterations before the step is rejected
+const int    nwtGoodIt       = 4;    // dt grows if Newton converged in fewer iterations
+const int    nwtBadIt        = 8;    // dt shrinks if Newton took more iterations
+const int    linBadIt        = 200;  // dt shrinks if linear solver took more iterations
+const double dCTarget        = 0.2;  // desired max concentration change per step
+const double dtGrow          = 1.5;
+const double dtShrink        = 0.7;  // dt reduction after a slow but accepted step
+const double dtChangeCut     = 0.5;  // strongest reduction by concentration change
+const double dtCut           = 0.5;  // dt reduction after a rejected step
+
+// Time derivative du/dt = (a0*u^{n+1} + a1*u^n + a2*u^{n-1}) / dt,
+// backward Euler or variable step BDF2 (-time bdf2)
+bool         useBDF2         = false;
+double       dtPrev          = 0.;   // previous accepted step, 0 before the first one
+double       bdfA[3]         = {1., -1., 0.};
+
+// Preconditioner reuse: rebuild when linear iterations grow pcGrowth times
+// compared to the first solve with current preconditioner, after pcMaxAge
+// Newton iterations, or at a new time step if pcStepRebuild is set.
+// pcMaxAge = 1 rebuilds on every Newton iteration
+int          pcMaxAge        = 1;
+double       pcGrowth        = 2.;
+bool         pcStepRebuild   = true;
+
+// Inexact Newton: linear tolerance from Eisenstat-Walker choice 1 or 2 (-ew),
+// ewChoice = 0 solves every linear system to linTol
+int          ewChoice        = 0;
+const double linTol          = 1e-12;
+const double ewEta0          = 0.5;  // tolerance for the first Newton iteration
+const double ewEtaMax        = 0.9;
+const double ewGamma         = 0.9;  // choice 2 parameters
+const double ewAlpha         = 2.;
+
+// Newton globalization: backtracking line search on |R|_2 (-ls 1)
+// and Appleyard chopping of updates (-chop 1): concentration is kept
+// in [0,1], changes of head and concentration per iteration are limited
+bool         lineSearch      = false;
+const double lsMinW          = 1./16; // smallest line search step
+bool         chopping        = false;
+double       dHMax           = 1.;
+double       dCMax           = 0.2;
+
+// Linear solver for the fully implicit system (-lin): inner_ilu2 on the
+// whole Jacobian or FGMRES with two-stage CPR preconditioner (see CPRSolver).
+// With -lin_cmp 1 every system is also solved by inner_ilu2 to compare iterations
+bool         useCPR          = false;
+bool         linCompare      = false;
+string       cprPressure     = "inner_mptiluc"; // solver type for the head stage
+const double cprPressureTol  = 1e-2;
+const int    cprRestart      = 30;
+
+// Acceleration of splitting iterations in the sequential scheme (-accel)
+enum{
+    ACCEL_NONE = 0,
+    ACCEL_AITKEN,
+    ACCEL_ANDERSON
+};
+int          splitAccel      = ACCEL_NONE;
+int          andersonDepth   = 5;
+const double aitkenMin       = 0.1;  // bounds of Aitken relaxation factor
+const double aitkenMax       = 2.;
+
+// Output: ParaView collection of binary VTU files or legacy VTK files
+// (-out pvd|vtk), written every outEvery steps and/or every outDt
+// of model time, and at the final time
+bool         outLegacy       = false;
+string       outPrefix       = "sol";
+int          outEvery        = 1;    // 0 - off
+double       outDt           = 0.;   // 0 - off
+string       outFields       = tagNameHead + "," + tagNameConc; // cell tags for pvd output
+bool         outAsync        = true; // pvd files are written by a background thread
+const size_t outQueue        = 2;    // snapshots in flight, time loop waits beyond that
+
+// Advection scheme (-adv): first order upwind or MUSCL with least squares
+// gradients and Barth-Jespersen or Venkatakrishnan limiter (-limiter).
+// In implicit modes the second order part is a deferred correction taken
+// at the current iterate, the Jacobian stays first order
+enum{
+    LIM_BJ = 0,
+    LIM_VENKAT
+};
+bool         advMUSCL        = false;
+int          limiterType     = LIM_BJ;
+const double venkatK         = 1.;   // Venkatakrishnan limiter constant
+
+// Courant number of explicit transport substeps in IMPES mode (-cfl).
+// Limited MUSCL keeps concentration bounded only up to cflMUSCL
+double       cflImpes        = 0.9;
+const double cflMUSCL        = 0.5;
+
+// Checkpoints: binary file <chkPrefix>.chk written every chkEvery accepted
+// steps (0 - off), run continues from it with -restart <file>
+int          chkEvery        = 0;
+string       chkPrefix       = "checkpoint";
+string       restartFile     = "";
+
+// Adaptive refinement (-amr 1): every amrEvery accepted steps cells where
+// concentration jumps to a neighbour by more than amrRefine are split,
+// families of children with jumps below amrCoarsen are united back.
+// Levels of neighbouring cells differ at most by one
+bool         useAMR          = false;
+int          amrEvery        = 1;
+int          amrMaxLevel     = 2;
+double       amrRefine       = 0.1;
+double       amrCoarsen      = 0.02;
 
-const double dt              = 1e-3;
-const int    nt              = 25;
 const double volConcExp      = 1e3;
 const double phi             = 0.4;
 const double sstor           = 1e-6;
 const double rho0            = 1e3;
 const double D               = 1e-4;
+// Unit vector pointing up, elevation is z = gravityDir * x (-gravity),
+// normalized after reading options
+double       gravityDir[2]   = {0., 1.};
 variable density(variable C)
 {
     return rho0 + volConcExp * C;
 }
 
+// Coefficients bdfA of the time derivative for current dt and dtPrev
+void setTimeCoefficients()
+{
+    if(!useBDF2 || dtPrev <= 0.){
+        bdfA[0] = 1.;
+        bdfA[1] = -1.;
+        bdfA[2] = 0.;
+        return;
+    }
+    double w = dt / dtPrev;
+    bdfA[0] = (1. + 2.*w) / (1. + w);
+    bdfA[1] = -(1. + w);
+    bdfA[2] = w*w / (1. + w);
+}
+
 class Problem;
+class PreconditionerReuse;
+class ForcingTerm;
+class CPRSolver;
+class SplittingAcceleration;
+class OutputWriter;
+struct RunState;
 class Process;
 class Process_ConfinedFlow;
 class Process_Advection;
@@ -104,86 +247,203 @@ public:
 };
 
 
+// Flattened face data for residual kernels.
+// Cells are addressed by local ID. Flux -D grad U through face i is
+//     coefP[i]*U[back[i]] + coefM[i]*U[front[i]] + coef0[i],
+// boundary faces have front[i] = back[i] and coefM[i] = 0
+// (Neumann faces have also coefP[i] = 0)
+struct TPFA_FaceTable
+{
+    int ncells;
+    vector<int>    back, front;
+    vector<char>   interior;
+    vector<double> coefP, coefM, coef0;
+    vector<double> gradZ; // D grad z, gravity term
+};
+
 class FV_Diffusion_TPFA : public FV_Diffusion
 {
 protected:
+    string name; // tensor tag name, instances with different tensors keep separate tags
     Tag tagT; // TPFA transmissibility coeff
+    Tag tagG; // Gravity term T*(z_m - z_p)
+    TPFA_FaceTable table;
 public:
     void build();
+    void computeTrans(const Face &f);
+    void update(MarkerType changed);
+    void buildGravity();
+    void buildFaceTable();
     variable getDgradU(const Face &f, dynamic_variable &U);
-    double   getDgradZ(const Face &f);
-    FV_Diffusion_TPFA(Mesh *mm, string s1, string s2) : FV_Diffusion(mm,s1,s2) {}
+    double   getDgradZ(const Face &f) { return f.Real(tagG); }
+    const TPFA_FaceTable &faceTable() const { return table; }
+    void computeFluxes(const double *U, double *q) const;
+    FV_Diffusion_TPFA(Mesh *mm, string s1, string s2) : FV_Diffusion(mm,s1,s2), name(s1) {}
     ~FV_Diffusion_TPFA() {}
 };
 
 void FV_Diffusion_TPFA::build()
 {
-    tagT = m->CreateTag("TPFA_trans", DATA_REAL, FACE, NONE, 1);
+    tagT = m->CreateTag("TPFA_trans_" + name, DATA_REAL, FACE, NONE, 1);
+    for(auto iface = m->BeginFace(); iface != m->EndFace(); iface++)
+        computeTrans(iface->getAsFace());
+    buildGravity();
+    buildFaceTable();
+}
+
+// After mesh adaptation only faces of cells with new geometry
+// (marked by changed) get new transmissibilities, the others keep
+// the values of this instance (tags are per tensor)
+void FV_Diffusion_TPFA::update(MarkerType changed)
+{
     for(auto iface = m->BeginFace(); iface != m->EndFace(); iface++){
         Face f = iface->getAsFace();
-        double xf[2];
-        f.Barycenter(xf);
-
-        if(f.Boundary()){            // Here 'p' and 'm' refer to '+' and '-'
-            Cell cp = f.BackCell();
-            double xp[2];
-            cp.Barycenter(xp);
-
-            rMatrix Dp(2,2), ne(2,1), lp(2,1);
-            // initialize diffusion tensors
-            Dp(0,0) = cp.RealArray(tagD)[0];
-            Dp(0,1) = cp.RealArray(tagD)[2];
-            Dp(1,0) = cp.RealArray(tagD)[2];
-            Dp(1,1) = cp.RealArray(tagD)[1];
-
-            // Get unit normal for face
-            f.UnitNormal(ne.data());
-
-            // Compute l's
-            lp(0,0) = xf[0] - xp[0];
-            lp(1,0) = xf[1] - xp[1];
-            lp /= (xf[0] - xp[0])*(xf[0] - xp[0]) + (xf[1] - xp[1])*(xf[1] - xp[1]);
-
-            double coef = (Dp*lp).DotProduct(ne);
-            f.Real(tagT) = coef;
-        }
-        else{ // internal face
-            // Here 'p' and 'm' refer to '+' and '-'
-            Cell cp = f.BackCell(), cm = f.FrontCell();
-            double xp[2], xm[2];
-            cp.Barycenter(xp);
-            cm.Barycenter(xm);
+        Cell cp = f.BackCell(), cm = f.FrontCell();
+        if(cp.GetMarker(changed) || (cm.isValid() && cm.GetMarker(changed)))
+            computeTrans(f);
+    }
+    buildGravity();
+    buildFaceTable();
+}
+
+void FV_Diffusion_TPFA::computeTrans(const Face &f)
+{
+    double xf[2];
+    f.Barycenter(xf);
+
+    if(f.Boundary()){            // Here 'p' and 'm' refer to '+' and '-'
+        Cell cp = f.BackCell();
+        double xp[2];
+        cp.Barycenter(xp);
+
+        rMatrix Dp(2,2), ne(2,1), lp(2,1);
+        // initialize diffusion tensors
+        Dp(0,0) = cp.RealArray(tagD)[0];
+        Dp(0,1) = cp.RealArray(tagD)[2];
+        Dp(1,0) = cp.RealArray(tagD)[2];
+        Dp(1,1) = cp.RealArray(tagD)[1];
 
-            rMatrix Dp(2,2), Dm(2,2), ne(2,1), lp(2,1), lm(2,1);
-            // initialize diffusion tensors
-            Dp(0,0) = cp.RealArray(tagD)[0];
-            Dp(0,1) = cp.RealArray(tagD)[2];
-            Dp(1,0) = cp.RealArray(tagD)[2];
-            Dp(1,1) = cp.RealArray(tagD)[1];
-            Dm(0,0) = cm.RealArray(tagD)[0];
-            Dm(0,1) = cm.RealArray(tagD)[2];
-            Dm(1,0) = cm.RealArray(tagD)[2];
-            Dm(1,1) = cm.RealArray(tagD)[1];
+        // Get unit normal for face
+        f.UnitNormal(ne.data());
 
-            // Get unit normal for face
-            f.UnitNormal(ne.data());
+        // Compute l's
+        lp(0,0) = xf[0] - xp[0];
+        lp(1,0) = xf[1] - xp[1];
+        lp /= (xf[0] - xp[0])*(xf[0] - xp[0]) + (xf[1] - xp[1])*(xf[1] - xp[1]);
+
+        double coef = (Dp*lp).DotProduct(ne);
+        f.Real(tagT) = coef;
+    }
+    else{ // internal face
+        // Here 'p' and 'm' refer to '+' and '-'
+        Cell cp = f.BackCell(), cm = f.FrontCell();
+        double xp[2], xm[2];
+        cp.Barycenter(xp);
+        cm.Barycenter(xm);
+
+        rMatrix Dp(2,2), Dm(2,2), ne(2,1), lp(2,1), lm(2,1);
+        // initialize diffusion tensors
+        Dp(0,0) = cp.RealArray(tagD)[0];
+        Dp(0,1) = cp.RealArray(tagD)[2];
+        Dp(1,0) = cp.RealArray(tagD)[2];
+        Dp(1,1) = cp.RealArray(tagD)[1];
+        Dm(0,0) = cm.RealArray(tagD)[0];
+        Dm(0,1) = cm.RealArray(tagD)[2];
+        Dm(1,0) = cm.RealArray(tagD)[2];
+        Dm(1,1) = cm.RealArray(tagD)[1];
+
+        // Get unit normal for face
+        f.UnitNormal(ne.data());
+
+        // Compute l's
+        lp(0,0) = xf[0] - xp[0];
+        lp(1,0) = xf[1] - xp[1];
+        lp /= (xf[0] - xp[0])*(xf[0] - xp[0]) + (xf[1] - xp[1])*(xf[1] - xp[1]);
+        lm(0,0) = xf[0] - xm[0];
+        lm(1,0) = xf[1] - xm[1];
+        lm /= (xf[0] - xm[0])*(xf[0] - xm[0]) + (xf[1] - xm[1])*(xf[1] - xm[1]);
+
+        double coef = (Dp*lp).DotProduct(ne) * (Dm*lm).DotProduct(ne);
+        coef /= ((Dp*lp).DotProduct(ne) - (Dm*lm).DotProduct(ne));
+        f.Real(tagT) = -coef;
+        //printf("face %d: T = %e\n", f.LocalID(), coef);
+    }
+}
 
-            // Compute l's
-            lp(0,0) = xf[0] - xp[0];
-            lp(1,0) = xf[1] - xp[1];
-            lp /= (xf[0] - xp[0])*(xf[0] - xp[0]) + (xf[1] - xp[1])*(xf[1] - xp[1]);
-            lm(0,0) = xf[0] - xm[0];
-            lm(1,0) = xf[1] - xm[1];
-            lm /= (xf[0] - xm[0])*(xf[0] - xm[0]) + (xf[1] - xm[1])*(xf[1] - xm[1]);
+// Gravity term D grad z = T * (z_m - z_p), z = gravityDir * x,
+// z_m is taken at the face for boundary faces
+void FV_Diffusion_TPFA::buildGravity()
+{
+    tagG = m->CreateTag("TPFA_gravity_" + name, DATA_REAL, FACE, NONE, 1);
+    for(auto iface = m->BeginFace(); iface != m->EndFace(); iface++){
+        Face f = iface->getAsFace();
+        Cell cp = f.BackCell(), cm = f.FrontCell();
+        double xp[3] = {0., 0., 0.}, xm[3] = {0., 0., 0.};
+        cp.Barycenter(xp);
+        if(cm.isValid())
+            cm.Barycenter(xm);
+        else
+            f.Barycenter(xm);
+        double dz = 0.;
+        for(int k = 0; k < 2; k++)
+            dz += gravityDir[k] * (xm[k] - xp[k]);
+        f.Real(tagG) = f.Real(tagT) * dz;
+    }
+}
 
-            double coef = (Dp*lp).DotProduct(ne) * (Dm*lm).DotProduct(ne);
-            coef /= ((Dp*lp).DotProduct(ne) - (Dm*lm).DotProduct(ne));
-            f.Real(tagT) = -coef;
-            //printf("face %d: T = %e\n", f.LocalID(), coef);
+// Has to be called again if boundary conditions change
+void FV_Diffusion_TPFA::buildFaceTable()
+{
+    unsigned nf = m->NumberOfFaces();
+    table.ncells = m->CellLastLocalID();
+    table.back.resize(nf);
+    table.front.resize(nf);
+    table.interior.resize(nf);
+    table.coefP.resize(nf);
+    table.coefM.resize(nf);
+    table.coef0.resize(nf);
+    table.gradZ.resize(nf);
+
+    unsigned i = 0;
+    for(auto iface = m->BeginFace(); iface != m->EndFace(); iface++, i++){
+        Face f = iface->getAsFace();
+        Cell cp = f.BackCell(), cm = f.FrontCell();
+        double T = f.Real(tagT);
+        table.back[i]  = cp.LocalID();
+        table.gradZ[i] = getDgradZ(f);
+        if(cm.isValid()){
+            table.front[i]    = cm.LocalID();
+            table.interior[i] = 1;
+            table.coefP[i]    = T;
+            table.coefM[i]    = -T;
+            table.coef0[i]    = 0.;
+            continue;
+        }
+        table.front[i]    = cp.LocalID();
+        table.interior[i] = 0;
+        table.coefM[i]    = 0.;
+        if(f.RealArray(tagBC)[0] > 0.){ // Neumann
+            table.coefP[i] = 0.;
+            table.coef0[i] = f.RealArray(tagBC)[1];
+        }
+        else{                           // Dirichlet
+            table.coefP[i] = T;
+            table.coef0[i] = -T * f.RealArray(tagBC)[1];
         }
     }
 }
 
+// Fluxes -D grad U for all faces, U is indexed by cell local ID.
+// Plain loop over contiguous arrays, left for the compiler to vectorize
+void FV_Diffusion_TPFA::computeFluxes(const double *U, double *q) const
+{
+    const int    *bk = table.back.data(), *fr = table.front.data();
+    const double *cp = table.coefP.data(), *cm = table.coefM.data(), *c0 = table.coef0.data();
+    int nf = static_cast<int>(table.back.size());
+    for(int i = 0; i < nf; i++)
+        q[i] = cp[i]*U[bk[i]] + cm[i]*U[fr[i]] + c0[i];
+}
+
 variable FV_Diffusion_TPFA::getDgradU(const Face &f, dynamic_variable &U)
 {
     variable res;
@@ -204,26 +464,6 @@ variable FV_Diffusion_TPFA::getDgradU(const Face &f, dynamic_variable &U)
     return res;
 }
 
-double FV_Diffusion_TPFA::getDgradZ(const Face &f)
-{
-    double res;
-    if(f.Boundary()){
-        Cell cp = f.BackCell();
-        double xf[2], xp[2];
-        f.Barycenter(xf);
-        cp.Barycenter(xp);
-        res = f.Real(tagT) * (xf[1] - xp[1]);
-    }
-    else{
-        Cell cp = f.BackCell(), cm = f.FrontCell();
-        double xm[2], xp[2];
-        cm.Barycenter(xm);
-        cp.Barycenter(xp);
-        res = f.Real(tagT) * (xm[1] - xp[1]);
-    }
-    return res;
-}
-
 // =====================================================
 
 class Process
@@ -235,6 +475,8 @@ public:
     Process(Mesh *mm, vector<dynamic_variable> &dvars){ m = mm; }
     virtual ~Process(){}
     virtual void fillResidual(Residual &R) = 0;
+    // After mesh adaptation, changed marks cells with new geometry
+    virtual void meshChanged(MarkerType) {}
     void setSteady(bool b) { steady = b; }
 };
 
@@ -243,12 +485,19 @@ class Process_ConfinedFlow : public Process
 private:
     FV_Diffusion_TPFA tpfa;
     dynamic_variable varH, varC;
-    Tag oldH, oldC;
+    Tag oldH, oldC, oldH2, oldC2;
+    Tag tagFlux; // Darcy flux -K grad H through faces, AD variable
+    // Kernel arrays: cell values and unknown indices by local ID, face fluxes
+    vector<double> valH, valC, qD;
+    vector<INMOST_DATA_ENUM_TYPE> idxH, idxC;
+    void gatherCells();
 public:
     Process_ConfinedFlow(Mesh *mm, vector<dynamic_variable> &dvars);
     ~Process_ConfinedFlow(){}
     void fillResidual(Residual &R);
+    void computeFluxes(bool frozenHead = false);
     variable getFlux(const Face &f);
+    void meshChanged(MarkerType changed) { tpfa.update(changed); }
 };
 
 Process_ConfinedFlow::Process_ConfinedFlow(Mesh *mm, vector<dynamic_variable> &dvars)
@@ -259,47 +508,110 @@ Process_ConfinedFlow::Process_ConfinedFlow(Mesh *mm, vector<dynamic_variable> &d
     varC = dvars[1];
     oldH = m->GetTag(tagNameHeadPrev);
     oldC = m->GetTag(tagNameConcPrev);
+    oldH2 = m->GetTag(tagNameHeadPrev2);
+    oldC2 = m->GetTag(tagNameConcPrev2);
+    tagFlux = m->CreateTag(tagNameDarcy, DATA_VARIABLE, FACE, NONE, 1);
 }
 
-void Process_ConfinedFlow::fillResidual(Residual &R)
+// Fills face flux cache for advection with respect to currently
+// active unknowns. Has to be called whenever head
+// or the set of active unknowns changes.
+// With frozenHead only values are kept (no derivatives),
+// they are taken from the face table as in fillResidual
+void Process_ConfinedFlow::computeFluxes(bool frozenHead)
 {
+    if(frozenHead){
+        gatherCells();
+        qD.resize(tpfa.faceTable().back.size());
+        tpfa.computeFluxes(valH.data(), qD.data());
+        unsigned i = 0;
+        for(auto iface = m->BeginFace(); iface != m->EndFace(); iface++, i++)
+            iface->Variable(tagFlux) = qD[i];
+        return;
+    }
     for(auto iface = m->BeginFace(); iface != m->EndFace(); iface++){
         Face f = iface->getAsFace();
-        Cell cp = f.BackCell(), cm = f.FrontCell();
-        variable q = -1. * tpfa.getDgradU(f, varH);
-
-        variable dens;
-        if(cm.isValid())// && false)
-            dens = 0.5 * (density(varC(cp) + density(varC(cm))));
-        else
-            dens = density(varC(cp));
-
-        q += (dens - rho0)/rho0 * tpfa.getDgradZ(f);
+        f.Variable(tagFlux) = -1. * tpfa.getDgradU(f, varH);
+    }
+}
 
-        q *= dens;
+// Cell values and indices of unknowns (ENUMUNDEF for inactive ones)
+void Process_ConfinedFlow::gatherCells()
+{
+    unsigned nc = tpfa.faceTable().ncells;
+    valH.resize(nc);
+    valC.resize(nc);
+    idxH.resize(nc);
+    idxC.resize(nc);
+    for(auto icell = m->BeginCell(); icell != m->EndCell(); icell++){
+        Cell c = icell->getAsCell();
+        int k = c.LocalID();
+        valH[k] = varH.Value(c);
+        valC[k] = varC.Value(c);
+        idxH[k] = varH.isUnknown(c) ? varH.Index(c) : ENUMUNDEF;
+        idxC[k] = varC.isUnknown(c) ? varC.Index(c) : ENUMUNDEF;
+    }
+}
 
-        R[varH.Index(cp)] -= q;
-        if(cm.isValid())
-            R[varH.Index(cm)] += q;
+// Face part is evaluated on flat arrays with derivatives written by hand:
+//     q = rho * (qD + (rho - rho0)/rho0 * gz),
+//     rho = rho0 + volConcExp * (wp*Cp + wm*Cm),
+// where qD = -K grad H and wp = wm = 1/2 for interior faces
+void Process_ConfinedFlow::fillResidual(Residual &R)
+{
+    const TPFA_FaceTable &ft = tpfa.faceTable();
+    unsigned nf = static_cast<unsigned>(ft.back.size());
+    gatherCells();
+    qD.resize(nf);
+    tpfa.computeFluxes(valH.data(), qD.data());
+
+    Sparse::Vector &res = R.GetResidual();
+    Sparse::Matrix &jac = R.GetJacobian();
+    for(unsigned i = 0; i < nf; i++){
+        int p = ft.back[i], q = ft.front[i];
+        double wp = ft.interior[i] ? 0.5 : 1.0, wm = ft.interior[i] ? 0.5 : 0.0;
+        double dens = rho0 + volConcExp * (wp*valC[p] + wm*valC[q]);
+        double gz   = ft.gradZ[i];
+        double flux = qD[i] + (dens - rho0)/rho0 * gz;
+        double val  = dens * flux;
+        double dDens = flux + dens/rho0 * gz; // d(val)/d(dens)
+        double dHp = dens * ft.coefP[i], dHm = dens * ft.coefM[i];
+        double dCp = dDens * volConcExp * wp, dCm = dDens * volConcExp * wm;
+
+        INMOST_DATA_ENUM_TYPE rows[2] = {idxH[p], ft.interior[i] ? idxH[q] : ENUMUNDEF};
+        double sgn[2] = {-1., 1.};
+        for(int r = 0; r < 2; r++){
+            if(rows[r] == ENUMUNDEF)
+                continue;
+            Sparse::Row &row = jac[rows[r]];
+            res[rows[r]] += sgn[r] * val;
+            if(idxH[p] != ENUMUNDEF) row[idxH[p]] += sgn[r] * dHp;
+            if(idxC[p] != ENUMUNDEF) row[idxC[p]] += sgn[r] * dCp;
+            if(ft.interior[i]){
+                if(idxH[q] != ENUMUNDEF) row[idxH[q]] += sgn[r] * dHm;
+                if(idxC[q] != ENUMUNDEF) row[idxC[q]] += sgn[r] * dCm;
+            }
+        }
     }
     for(auto icell = m->BeginCell(); icell != m->EndCell(); icell++){
         Cell cell = icell->getAsCell();
         if(!steady){
-            variable val = (varH(cell) - cell.Real(oldH))/dt * cell.Volume();
+            variable val = (bdfA[0]*varH(cell) + bdfA[1]*cell.Real(oldH) + bdfA[2]*cell.Real(oldH2))/dt * cell.Volume();
             val *= sstor;
             val *= density(varC(cell));
             R[varH.Index(cell)] -= val;
         }
 
-        R[varH.Index(cell)] -= phi * volConcExp * (varC(cell) - cell.Real(oldC)) / dt * cell.Volume();
+        R[varH.Index(cell)] -= phi * volConcExp * (bdfA[0]*varC(cell) + bdfA[1]*cell.Real(oldC) + bdfA[2]*cell.Real(oldC2)) / dt * cell.Volume();
     }
 //    if(!steady)
 //        cout << "Adding dH/dt" << endl;
 }
 
+// Cached flux, see computeFluxes
 variable Process_ConfinedFlow::getFlux(const Face &f)
 {
-    return -1. * tpfa.getDgradU(f, varH);
+    return f.Variable(tagFlux);
 //    rMatrix U(1,2), ne(2,1);
 //    U(0,0) = 100;
 //    U(0,1) = 200;
@@ -313,14 +625,25 @@ class Process_Advection : public Process
 {
 private:
     dynamic_variable varC;
-    Tag oldC;
+    Tag oldC, oldC2;
     Tag waterFlux;
     Process_ConfinedFlow *flow;
+    // MUSCL data by cell / face local ID
+    vector<double> xc, xf, hc;              // centroids, face barycenters, cell sizes
+    vector< vector<int> > nbCells;          // interior neighbours of a cell
+    vector< vector<double> > nbCoef;        // least squares gradient weights, 2 per neighbour
+    vector< vector<double> > faceOff;       // face barycenter - centroid, 2 per face
+    vector<double> valC, grad;
+    void buildReconstruction();
+    void reconstruct(const vector<double> &C);
+    double faceCorrection(int f, int c) const;
 public:
     Process_Advection(Mesh *, vector<dynamic_variable> &);
     ~Process_Advection(){}
     void fillResidual(Residual &R);
+    void addRate(const vector<double> &C, vector<double> &rate, vector<double> *diag = nullptr);
     void setFlow(Process_ConfinedFlow *p) { flow = p; }
+    void meshChanged(MarkerType) { if(advMUSCL) buildReconstruction(); }
 };
 
 Process_Advection::Process_Advection(Mesh *mm, vector<dynamic_variable> &dvars)
@@ -329,49 +652,174 @@ Process_Advection::Process_Advection(Mesh *mm, vector<dynamic_variable> &dvars)
     varC = dvars[0];
     steady = true;
     oldC = m->GetTag(tagNameConcPrev);
+    oldC2 = m->GetTag(tagNameConcPrev2);
+    if(advMUSCL)
+        buildReconstruction();
 }
 
-void Process_Advection::fillResidual(Residual &R)
+// Gradient of cell c is sum_j w_j (C_j - C_c) over interior neighbours,
+// weights come from weighted least squares with weight 1/|x_j - x_c|^2
+void Process_Advection::buildReconstruction()
 {
+    int nc = m->CellLastLocalID(), nf = m->FaceLastLocalID();
+    xc.assign(2*nc, 0.);
+    xf.assign(2*nf, 0.);
+    hc.assign(nc, 0.);
+    nbCells.assign(nc, vector<int>());
+    nbCoef.assign(nc, vector<double>());
+    faceOff.assign(nc, vector<double>());
     for(auto icell = m->BeginCell(); icell != m->EndCell(); icell++){
-        Cell cell = icell->getAsCell();
-        if(!steady){
-            double V = cell.Volume();
-            R[varC.Index(cell)] -= (varC(cell) - cell.Real(oldC))/dt * V;
-        }
-
-        auto faces = cell.getFaces();
-        for(auto iface = faces.begin(); iface != faces.end(); iface++){
-            Face f = iface->getAsFace();
-            variable flux = flow->getFlux(f);
-            Cell cp = f.BackCell(), cm = f.FrontCell();
-            if(cm.isValid()){
-                if(flux.GetValue() > 0.)
-                    flux *= varC(cp);
-                else
-                    flux *= varC(cm);
-                if(cell == cm)
-                    flux *= -1;
-//                if(cell == cm){
-//                    if(flux.GetValue() > 0.)
-//                        flux *= -varC(cm);
-//                    else
-//                        flux *= -varC(cp);
-//                }
-//                else{
-//                    if(flux.GetValue() > 0.)
-//                        flux *= varC(cp);
-//                    else
-//                        flux *= varC(cm);
-//                }
+        double x[3];
+        icell->Barycenter(x);
+        xc[2*icell->LocalID()]     = x[0];
+        xc[2*icell->LocalID() + 1] = x[1];
+        hc[icell->LocalID()] = sqrt(icell->Volume());
+    }
+    for(auto iface = m->BeginFace(); iface != m->EndFace(); iface++){
+        double x[3];
+        iface->Barycenter(x);
+        xf[2*iface->LocalID()]     = x[0];
+        xf[2*iface->LocalID() + 1] = x[1];
+    }
+    for(auto icell = m->BeginCell(); icell != m->EndCell(); icell++){
+        Cell c = icell->getAsCell();
+        int k = c.LocalID();
+        double M[3] = {0., 0., 0.}; // symmetric 2x2
+        ElementArray<Face> faces = c.getFaces();
+        for(unsigned i = 0; i < faces.size(); i++){
+            int f = faces[i].LocalID();
+            faceOff[k].push_back(xf[2*f] - xc[2*k]);
+            faceOff[k].push_back(xf[2*f+1] - xc[2*k+1]);
+            Cell n = c.Neighbour(faces[i]);
+            if(!n.isValid())
+                continue;
+            int j = n.LocalID();
+            double dx = xc[2*j] - xc[2*k], dy = xc[2*j+1] - xc[2*k+1];
+            double w = 1. / (dx*dx + dy*dy);
+            M[0] += w*dx*dx;
+            M[1] += w*dx*dy;
+            M[2] += w*dy*dy;
+            nbCells[k].push_back(j);
+        }
+        double det = M[0]*M[2] - M[1]*M[1];
+        bool ok = fabs(det) > 1e-12 * (M[0]*M[2] + 1e-300);
+        for(int j : nbCells[k]){
+            double dx = xc[2*j] - xc[2*k], dy = xc[2*j+1] - xc[2*k+1];
+            double w = 1. / (dx*dx + dy*dy);
+            nbCoef[k].push_back(ok ? w * ( M[2]*dx - M[1]*dy) / det : 0.);
+            nbCoef[k].push_back(ok ? w * (-M[1]*dx + M[0]*dy) / det : 0.);
+        }
+    }
+}
+
+// Limited gradients for values C by cell local ID
+void Process_Advection::reconstruct(const vector<double> &C)
+{
+    grad.assign(2*C.size(), 0.);
+    for(auto icell = m->BeginCell(); icell != m->EndCell(); icell++){
+        int k = icell->LocalID();
+        double gx = 0., gy = 0., cmin = C[k], cmax = C[k];
+        for(size_t j = 0; j < nbCells[k].size(); j++){
+            double d = C[nbCells[k][j]] - C[k];
+            gx += nbCoef[k][2*j]     * d;
+            gy += nbCoef[k][2*j + 1] * d;
+            cmin = min(cmin, C[nbCells[k][j]]);
+            cmax = max(cmax, C[nbCells[k][j]]);
+        }
+        double lim = 1.;
+        for(size_t i = 0; i < faceOff[k].size(); i += 2){
+            double d2 = gx*faceOff[k][i] + gy*faceOff[k][i+1];
+            if(fabs(d2) < 1e-14)
+                continue;
+            double d1 = (d2 > 0.) ? cmax - C[k] : cmin - C[k];
+            if(limiterType == LIM_BJ)
+                lim = min(lim, min(1., d1 / d2));
+            else{
+                double eps2 = pow(venkatK * hc[k], 3);
+                lim = min(lim, (d1*d1 + eps2 + 2.*d2*d1) / (d1*d1 + 2.*d2*d2 + d1*d2 + eps2));
             }
-            else
-                flux *= varC(cp);
-            R[varC.Index(cell)] -= flux;
+        }
+        grad[2*k]     = lim * gx;
+        grad[2*k + 1] = lim * gy;
+    }
+}
+
+// Reconstructed minus cell value at face f from upwind cell c
+double Process_Advection::faceCorrection(int f, int c) const
+{
+    return grad[2*c] * (xf[2*f] - xc[2*c]) + grad[2*c+1] * (xf[2*f+1] - xc[2*c+1]);
+}
+
+// Each face flux is taken once from the flow cache
+// and scattered to both cells with opposite signs
+void Process_Advection::fillResidual(Residual &R)
+{
+    if(!steady){
+        for(auto icell = m->BeginCell(); icell != m->EndCell(); icell++){
+            Cell cell = icell->getAsCell();
+            double V = cell.Volume();
+            R[varC.Index(cell)] -= (bdfA[0]*varC(cell) + bdfA[1]*cell.Real(oldC) + bdfA[2]*cell.Real(oldC2))/dt * V;
+        }
+    }
+
+    if(advMUSCL){
+        valC.resize(m->CellLastLocalID());
+        for(auto icell = m->BeginCell(); icell != m->EndCell(); icell++)
+            valC[icell->LocalID()] = varC.Value(icell->self());
+        reconstruct(valC);
+    }
+
+    for(auto iface = m->BeginFace(); iface != m->EndFace(); iface++){
+        Face f = iface->getAsFace();
+        variable flux = flow->getFlux(f);
+        Cell cp = f.BackCell(), cm = f.FrontCell();
+        if(cm.isValid()){
+            Cell up = (flux.GetValue() > 0.) ? cp : cm;
+            variable Cf = varC(up);
+            // Second order part as deferred correction, not differentiated
+            if(advMUSCL)
+                Cf += faceCorrection(f.LocalID(), up.LocalID());
+            flux *= Cf;
+            R[varC.Index(cp)] -= flux;
+            R[varC.Index(cm)] += flux;
+        }
+        else{
+            flux *= varC(cp);
+            R[varC.Index(cp)] -= flux;
+        }
+    }
+}
+
+// Explicit form of the face terms above for values C by cell local ID:
+// rate is the residual without storage, diag (if given) accumulates
+// -d(rate)/dC of the own cell (outflow fluxes)
+void Process_Advection::addRate(const vector<double> &C, vector<double> &rate, vector<double> *diag)
+{
+    if(advMUSCL)
+        reconstruct(C);
+    for(auto iface = m->BeginFace(); iface != m->EndFace(); iface++){
+        Face f = iface->getAsFace();
+        double flux = flow->getFlux(f).GetValue();
+        Cell cp = f.BackCell(), cm = f.FrontCell();
+        int p = cp.LocalID();
+        if(cm.isValid()){
+            int q = cm.LocalID();
+            double up = flux > 0. ? C[p] : C[q];
+            if(advMUSCL)
+                up += faceCorrection(f.LocalID(), flux > 0. ? p : q);
+            rate[p] -= flux * up;
+            rate[q] += flux * up;
+            if(diag && flux > 0.)
+                (*diag)[p] += flux;
+            else if(diag)
+                (*diag)[q] -= flux;
+        }
+        else{
+            rate[p] -= flux * C[p];
+            if(diag)
+                (*diag)[p] += max(flux, 0.);
         }
     }
-//    if(!steady)
-//        cout << "Adding dC/dt" << endl;
 }
 
 // =====================================================
@@ -381,11 +829,15 @@ class Process_Diffusion : public Process
 private:
     FV_Diffusion_TPFA tpfa;
     dynamic_variable varC;
-    Tag oldС;
+    Tag oldС, oldC2;
+    vector<double> valC, qC;               // Kernel arrays by cell local ID / face
+    vector<INMOST_DATA_ENUM_TYPE> idxC;
 public:
     Process_Diffusion(Mesh *mm, vector<dynamic_variable> &dvars);
     ~Process_Diffusion(){}
     void fillResidual(Residual &R);
+    void addRate(const vector<double> &C, vector<double> &rate, vector<double> *diag = nullptr);
+    void meshChanged(MarkerType changed) { tpfa.update(changed); }
 };
 
 Process_Diffusion::Process_Diffusion(Mesh *mm, vector<dynamic_variable> &dvars)
@@ -395,42 +847,983 @@ Process_Diffusion::Process_Diffusion(Mesh *mm, vector<dynamic_variable> &dvars)
     varC = dvars[0];
     steady = true;
     oldС = m->GetTag(tagNameConcPrev);
+    oldC2 = m->GetTag(tagNameConcPrev2);
 }
 
 void Process_Diffusion::fillResidual(Residual &R)
 {
-//    for(auto iface = m->BeginFace(); iface != m->EndFace(); iface++){
-//        Face f = iface->getAsFace();
-//        Cell cp = f.BackCell(), cm = f.FrontCell();
-//        variable q = -1. * tpfa.getDgradU(f, varC);
+    if(!steady){
+        for(auto icell = m->BeginCell(); icell != m->EndCell(); icell++){
+            Cell cell = icell->getAsCell();
+            double V = cell.Volume();
+            R[varC.Index(cell)] -= (bdfA[0]*varC(cell) + bdfA[1]*cell.Real(oldС) + bdfA[2]*cell.Real(oldC2))/dt * V;
+        }
+    }
 
-//        R[varC.Index(cp)] -= q;
-//        if(cm.isValid())
-//            R[varC.Index(cm)] += q;
-//    }
+    // Face part on flat arrays, TPFA flux is linear in C
+    const TPFA_FaceTable &ft = tpfa.faceTable();
+    unsigned nf = static_cast<unsigned>(ft.back.size());
+    valC.resize(ft.ncells);
+    idxC.resize(ft.ncells);
+    qC.resize(nf);
     for(auto icell = m->BeginCell(); icell != m->EndCell(); icell++){
-        Cell cell = icell->getAsCell();
-        if(!steady){
-            double V = cell.Volume();
-            R[varC.Index(cell)] -= (varC(cell) - cell.Real(oldС))/dt * V;
+        Cell c = icell->getAsCell();
+        valC[c.LocalID()] = varC.Value(c);
+        idxC[c.LocalID()] = varC.isUnknown(c) ? varC.Index(c) : ENUMUNDEF;
+    }
+    tpfa.computeFluxes(valC.data(), qC.data());
+
+    Sparse::Vector &res = R.GetResidual();
+    Sparse::Matrix &jac = R.GetJacobian();
+    for(unsigned i = 0; i < nf; i++){
+        int p = ft.back[i], q = ft.front[i];
+        INMOST_DATA_ENUM_TYPE rows[2] = {idxC[p], ft.interior[i] ? idxC[q] : ENUMUNDEF};
+        double sgn[2] = {-1., 1.};
+        for(int r = 0; r < 2; r++){
+            if(rows[r] == ENUMUNDEF)
+                continue;
+            Sparse::Row &row = jac[rows[r]];
+            res[rows[r]] += sgn[r] * qC[i];
+            if(idxC[p] != ENUMUNDEF && ft.coefP[i] != 0.) row[idxC[p]] += sgn[r] * ft.coefP[i];
+            if(ft.interior[i] && idxC[q] != ENUMUNDEF)     row[idxC[q]] += sgn[r] * ft.coefM[i];
         }
+    }
+}
 
-        auto faces = cell.getFaces();
-        for(auto iface = faces.begin(); iface != faces.end(); iface++){
-            variable flux = -1. * tpfa.getDgradU(iface->getAsFace(), varC);
-            if(cell == iface->FrontCell())
-                flux *= -1.;
-            R[varC.Index(cell)] -= flux;
+// Explicit form of the face terms, see Process_Advection::addRate
+void Process_Diffusion::addRate(const vector<double> &C, vector<double> &rate, vector<double> *diag)
+{
+    const TPFA_FaceTable &ft = tpfa.faceTable();
+    unsigned nf = static_cast<unsigned>(ft.back.size());
+    qC.resize(nf);
+    tpfa.computeFluxes(C.data(), qC.data());
+    for(unsigned i = 0; i < nf; i++){
+        int p = ft.back[i], q = ft.front[i];
+        rate[p] -= qC[i];
+        if(diag)
+            (*diag)[p] += ft.coefP[i];
+        if(ft.interior[i]){
+            rate[q] += qC[i];
+            if(diag)
+                (*diag)[q] -= ft.coefM[i];
         }
     }
-//    if(!steady)
-//        cout << "Adding dC/dt" << endl;
 }
 
 // =====================================================
 
 // =====================================================
 
+// Zeroes residual and Jacobian values in place. Rows keep their entries,
+// so the sparsity pattern of the first assembly is reused by later ones
+// (it can only grow, e.g. when upwind direction changes)
+void clearValues(Residual &R)
+{
+    Sparse::Vector &res = R.GetResidual();
+    Sparse::Matrix &jac = R.GetJacobian();
+    for(unsigned i = R.GetFirstIndex(); i < R.GetLastIndex(); i++){
+        res[i] = 0.;
+        Sparse::Row &row = jac[i];
+        for(unsigned k = 0; k < row.Size(); k++)
+            row.GetValue(k) = 0.;
+    }
+}
+
+// Number of stored entries, unchanged number means unchanged pattern
+// for matrices assembled after clearValues
+unsigned countEntries(Sparse::Matrix &A)
+{
+    unsigned beg, end, nnz = 0;
+    A.GetInterval(beg, end);
+    for(unsigned i = beg; i < end; i++)
+        nnz += A[i].Size();
+    return nnz;
+}
+
+// =====================================================
+
+// Keeps track of the age of the preconditioner in a Solver.
+// Between rebuilds only the matrix is replaced in the solver,
+// old factorization is used for Krylov iterations.
+// Each Solver (one per system) needs its own instance.
+// The solver is told when the matrix pattern did not change.
+class PreconditionerReuse
+{
+private:
+    int age;       // Newton iterations served by current preconditioner
+    int itsFresh;  // linear iterations of the first solve after rebuild
+    int itsLast;   // linear iterations of the last solve
+    bool force;    // rebuild on the next call
+    unsigned nnz;  // entries in the last matrix, 0 before the first one
+public:
+    PreconditionerReuse() : age(0), itsFresh(-1), itsLast(0), force(true), nnz(0) {}
+    void newTimeStep() { if(pcStepRebuild) force = true; }
+    void invalidate() { force = true; nnz = 0; } // new mesh, new pattern
+    bool isStale() const { return age > 1; }
+    bool needRebuild() const
+    {
+        return force || age >= pcMaxAge || (itsFresh >= 0 && itsLast > pcGrowth * max(itsFresh, 1));
+    }
+    template<class LinSolver>
+    void setMatrix(LinSolver &S, Sparse::Matrix &A, bool rebuild = false)
+    {
+        rebuild = rebuild || needRebuild();
+        unsigned nnzNew = countEntries(A);
+        S.SetMatrix(A, nnzNew != nnz, !rebuild);
+        nnz = nnzNew;
+        if(rebuild){
+            age = 0;
+            itsFresh = -1;
+            force = false;
+        }
+        age++;
+    }
+    void update(int its)
+    {
+        if(itsFresh < 0)
+            itsFresh = its;
+        itsLast = its;
+    }
+};
+
+// =====================================================
+
+// Chooses relative tolerance of the linear solver for each Newton iteration
+// from the history of nonlinear residual norms (Eisenstat, Walker, 1996).
+// Also estimates linear iterations saved compared to solving to linTol,
+// assuming the number of iterations grows as log of the tolerance.
+class ForcingTerm
+{
+private:
+    double eta;        // current forcing term
+    double normPrev;   // nonlinear residual norm at previous iteration
+    double linResPrev; // final linear residual norm at previous iteration
+    bool first;
+public:
+    double itsSaved;
+    ForcingTerm() : eta(ewEta0), normPrev(0.), linResPrev(0.), first(true), itsSaved(0.) {}
+    // Call at the start of every Newton loop
+    void reset() { first = true; }
+    // normF - current nonlinear residual, normStop - Newton stopping threshold
+    template<class LinSolver>
+    void setTolerance(LinSolver &S, double normF, double normStop)
+    {
+        double etaNew = linTol;
+        if(ewChoice != 0){
+            if(first)
+                etaNew = ewEta0;
+            else if(ewChoice == 1){
+                double a = 0.5 * (1. + sqrt(5.));
+                etaNew = fabs(normF - linResPrev) / normPrev;
+                if(pow(eta, a) > 0.1)
+                    etaNew = max(etaNew, pow(eta, a));
+            }
+            else{
+                etaNew = ewGamma * pow(normF / normPrev, ewAlpha);
+                if(ewGamma * pow(eta, ewAlpha) > 0.1)
+                    etaNew = max(etaNew, ewGamma * pow(eta, ewAlpha));
+            }
+            // No need to solve below the Newton stopping threshold
+            etaNew = max(etaNew, 0.5 * normStop / normF);
+            etaNew = min(ewEtaMax, max(linTol, etaNew));
+        }
+        eta = etaNew;
+        normPrev = normF;
+        first = false;
+        applyTolerance(S);
+    }
+    // Set current tolerance to another solver
+    template<class LinSolver>
+    void applyTolerance(LinSolver &S) const
+    {
+        char buf[32];
+        snprintf(buf, sizeof(buf), "%e", eta);
+        S.SetParameter("relative_tolerance", buf);
+    }
+    // Call after each solve with linear residual norm and iterations
+    void update(double linRes, int its)
+    {
+        linResPrev = linRes;
+        if(ewChoice != 0 && eta > linTol)
+            itsSaved += its * (log(linTol) / log(eta) - 1.);
+    }
+    // The solution vector is the initial guess, tolerance is relative
+    // to residual norm only with zero guess
+    void initialGuess(Sparse::Vector &x)
+    {
+        if(ewChoice != 0)
+            fill(x.Begin(), x.End(), 0.);
+    }
+};
+
+// =====================================================
+
+// Two-stage CPR preconditioner for the fully implicit Jacobian
+// inside restarted FGMRES (the head stage is an inexact inner solve).
+// Stage 1: quasi-IMPES reduction, the transport equation of a cell is added
+// to its flow equation with weight alpha = -J_hc / J_cc to remove the
+// concentration derivative on the diagonal; the resulting head system
+// is solved approximately by an INMOST solver of type cprPressure.
+// Stage 2: ILU(0) of the full Jacobian applied to the remaining residual.
+// Serial, as the rest of the code.
+class CPRSolver
+{
+private:
+    int n, nc;                    // sizes of full and head systems
+    unsigned beg;                 // first index of the full system
+    vector<int> cellH, cellC;     // per cell: head and conc unknown (from beg)
+    vector<int> cellOf;           // cell of a head unknown, -1 for conc
+    vector<double> alpha;         // quasi-IMPES weights
+    vector<int> ia, ja, diag;     // Jacobian in CSR, sorted columns
+    vector<double> a;
+    vector<int> perm;             // CSR position of each Jacobian row entry
+    vector<int> lia, lja, ldiag;  // ILU(0) pattern, kept with old preconditioner
+    vector<double> lu;
+    bool pivotOK;                 // ILU(0) factors have no zero pivot
+    vector<double> tmp1, tmp2;
+    Sparse::Matrix Ap;            // head system
+    Sparse::Vector rp, xp;
+    Solver Sp;
+    double rtol, atol;
+    int maxIts;
+    int its, itsP;
+    double res;
+    string reason;
+
+    void copyMatrix(Sparse::Matrix &A, bool ModifiedPattern);
+    double value(int i, int j) const;
+    bool factorILU0();
+    void buildHeadSystem();
+    void multiply(const vector<double> &x, vector<double> &y) const;
+    void applyILU0(vector<double> &x) const;
+    void applyCPR(const vector<double> &r, vector<double> &z);
+public:
+    int itsHead;   // total iterations of the head stage
+    int headFails; // head stage solves that failed, stage 1 skipped
+    CPRSolver(string pressureSolver);
+    void setUnknowns(const vector<int> &indH, const vector<int> &indC, unsigned first, unsigned last);
+    void SetParameter(string name, string val);
+    void SetMatrix(Sparse::Matrix &A, bool ModifiedPattern = true, bool OldPreconditioner = false);
+    bool Solve(Sparse::Vector &b, Sparse::Vector &x);
+    int Iterations() const { return its; }
+    double Residual() const { return res; }
+    string GetReason() const { return reason; }
+};
+
+CPRSolver::CPRSolver(string pressureSolver) : n(0), nc(0), beg(0), pivotOK(true), Sp(pressureSolver),
+    rtol(1e-12), atol(1e-15), maxIts(5000), its(0), itsP(0), res(0.), itsHead(0), headFails(0)
+{
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%e", cprPressureTol);
+    Sp.SetParameter("relative_tolerance", buf);
+    Sp.SetParameter("maximum_iterations", "50");
+}
+
+// indH, indC - Jacobian indices of head and concentration of every cell
+void CPRSolver::setUnknowns(const vector<int> &indH, const vector<int> &indC, unsigned first, unsigned last)
+{
+    beg = first;
+    n = static_cast<int>(last - first);
+    nc = static_cast<int>(indH.size());
+    cellH.resize(nc);
+    cellC.resize(nc);
+    alpha.assign(nc, 0.);
+    cellOf.assign(n, -1);
+    for(int k = 0; k < nc; k++){
+        cellH[k] = indH[k] - static_cast<int>(beg);
+        cellC[k] = indC[k] - static_cast<int>(beg);
+        cellOf[cellH[k]] = k;
+    }
+    tmp1.resize(n);
+    tmp2.resize(n);
+    Ap.SetInterval(0, nc);
+    rp.SetInterval(0, nc);
+    xp.SetInterval(0, nc);
+}
+
+void CPRSolver::SetParameter(string name, string val)
+{
+    if(name == "relative_tolerance")
+        rtol = atof(val.c_str());
+    else if(name == "absolute_tolerance")
+        atol = atof(val.c_str());
+    else if(name == "maximum_iterations")
+        maxIts = atoi(val.c_str());
+}
+
+// With unchanged pattern only values are scattered to the CSR arrays
+void CPRSolver::copyMatrix(Sparse::Matrix &A, bool ModifiedPattern)
+{
+    if(!ModifiedPattern && !perm.empty()){
+        int pos = 0;
+        for(int i = 0; i < n; i++){
+            Sparse::Row &r = A[beg + i];
+            for(unsigned k = 0; k < r.Size(); k++)
+                a[perm[pos++]] = r.GetValue(k);
+        }
+        return;
+    }
+    ia.assign(1, 0);
+    ja.clear();
+    a.clear();
+    perm.clear();
+    diag.resize(n);
+    vector< pair<int,int> > row; // column, entry number in the row (-1 for added diagonal)
+    for(int i = 0; i < n; i++){
+        Sparse::Row &r = A[beg + i];
+        int rowStart = static_cast<int>(perm.size());
+        perm.resize(rowStart + r.Size());
+        row.clear();
+        bool haveDiag = false;
+        for(unsigned k = 0; k < r.Size(); k++){
+            int j = static_cast<int>(r.GetIndex(k)) - static_cast<int>(beg);
+            row.push_back(make_pair(j, static_cast<int>(k)));
+            haveDiag = haveDiag || (j == i);
+        }
+        if(!haveDiag)
+            row.push_back(make_pair(i, -1));
+        sort(row.begin(), row.end());
+        for(auto &e : row){
+            if(e.first == i)
+                diag[i] = static_cast<int>(ja.size());
+            if(e.second >= 0)
+                perm[rowStart + e.second] = static_cast<int>(ja.size());
+            ja.push_back(e.first);
+            a.push_back(e.second >= 0 ? r.GetValue(e.second) : 0.);
+        }
+        ia.push_back(static_cast<int>(ja.size()));
+    }
+}
+
+double CPRSolver::value(int i, int j) const
+{
+    auto b = ja.begin() + ia[i], e = ja.begin() + ia[i+1];
+    auto p = lower_bound(b, e, j);
+    if(p != e && *p == j)
+        return a[p - ja.begin()];
+    return 0.;
+}
+
+// Returns false on a pivot that is zero relative to its matrix row
+bool CPRSolver::factorILU0()
+{
+    lia = ia;
+    lja = ja;
+    ldiag = diag;
+    lu = a;
+    for(int i = 0; i < n; i++){
+        for(int p = lia[i]; p < ldiag[i]; p++){
+            int k = lja[p];
+            lu[p] /= lu[ldiag[k]];
+            int pi = p + 1;
+            for(int q = ldiag[k] + 1; q < lia[k+1]; q++){
+                while(pi < lia[i+1] && lja[pi] < lja[q])
+                    pi++;
+                if(pi < lia[i+1] && lja[pi] == lja[q])
+                    lu[pi] -= lu[p] * lu[q];
+            }
+        }
+        double rmax = 0.;
+        for(int p = ia[i]; p < ia[i+1]; p++)
+            rmax = max(rmax, fabs(a[p]));
+        if(!(fabs(lu[ldiag[i]]) > 1e-14 * rmax))
+            return false;
+    }
+    return true;
+}
+
+void CPRSolver::buildHeadSystem()
+{
+    for(int k = 0; k < nc; k++){
+        int h = cellH[k], c = cellC[k];
+        double jcc = value(c, c);
+        alpha[k] = (jcc != 0.) ? -value(h, c) / jcc : 0.;
+        Sparse::Row &row = Ap[k];
+        row.Clear();
+        for(int p = ia[h]; p < ia[h+1]; p++)
+            if(cellOf[ja[p]] >= 0)
+                row[cellOf[ja[p]]] += a[p];
+        for(int p = ia[c]; p < ia[c+1]; p++)
+            if(cellOf[ja[p]] >= 0)
+                row[cellOf[ja[p]]] += alpha[k] * a[p];
+    }
+    Sp.SetMatrix(Ap);
+}
+
+// With OldPreconditioner only the matrix for Krylov iterations is replaced,
+// weights, head system and ILU(0) factors stay from the last rebuild
+void CPRSolver::SetMatrix(Sparse::Matrix &A, bool ModifiedPattern, bool OldPreconditioner)
+{
+    copyMatrix(A, ModifiedPattern);
+    if(OldPreconditioner && !lu.empty())
+        return;
+    buildHeadSystem();
+    pivotOK = factorILU0();
+}
+
+void CPRSolver::multiply(const vector<double> &x, vector<double> &y) const
+{
+    for(int i = 0; i < n; i++){
+        double s = 0.;
+        for(int p = ia[i]; p < ia[i+1]; p++)
+            s += a[p] * x[ja[p]];
+        y[i] = s;
+    }
+}
+
+void CPRSolver::applyILU0(vector<double> &x) const
+{
+    for(int i = 0; i < n; i++)
+        for(int p = lia[i]; p < ldiag[i]; p++)
+            x[i] -= lu[p] * x[lja[p]];
+    for(int i = n - 1; i >= 0; i--){
+        for(int p = ldiag[i] + 1; p < lia[i+1]; p++)
+            x[i] -= lu[p] * x[lja[p]];
+        x[i] /= lu[ldiag[i]];
+    }
+}
+
+void CPRSolver::applyCPR(const vector<double> &r, vector<double> &z)
+{
+    // Stage 1: head correction
+    for(int k = 0; k < nc; k++){
+        rp[k] = r[cellH[k]] + alpha[k] * r[cellC[k]];
+        xp[k] = 0.;
+    }
+    bool headOK = Sp.Solve(rp, xp);
+    itsP += Sp.Iterations();
+    fill(z.begin(), z.end(), 0.);
+    // Output of a failed head solve is not used, only stage 2 is applied
+    if(headOK)
+        for(int k = 0; k < nc; k++)
+            z[cellH[k]] = xp[k];
+    else
+        headFails++;
+    // Stage 2: ILU(0) on the remaining residual
+    multiply(z, tmp1);
+    for(int i = 0; i < n; i++)
+        tmp2[i] = r[i] - tmp1[i];
+    applyILU0(tmp2);
+    for(int i = 0; i < n; i++)
+        z[i] += tmp2[i];
+}
+
+// Restarted FGMRES, right preconditioned by CPR
+bool CPRSolver::Solve(Sparse::Vector &b, Sparse::Vector &x)
+{
+    const int m = cprRestart;
+    vector< vector<double> > V(m + 1, vector<double>(n)), Z(m, vector<double>(n));
+    vector<double> H((m + 1) * m), cs(m), sn(m), g(m + 1), y(m), xv(n), r(n), w(n);
+    its = itsP = 0;
+
+    for(int i = 0; i < n; i++)
+        xv[i] = x[beg + i];
+    multiply(xv, r);
+    double beta = 0.;
+    for(int i = 0; i < n; i++){
+        r[i] = b[beg + i] - r[i];
+        beta += r[i] * r[i];
+    }
+    beta = sqrt(beta);
+    double tol = max(rtol * beta, atol);
+    res = beta;
+    if(!pivotOK){
+        reason = "zero pivot in ILU(0)";
+        return false;
+    }
+    bool breakdown = false;
+    while(res > tol && its < maxIts && !breakdown){
+        for(int i = 0; i < n; i++)
+            V[0][i] = r[i] / beta;
+        fill(g.begin(), g.end(), 0.);
+        g[0] = beta;
+        int k = 0;
+        while(k < m && its < maxIts){
+            applyCPR(V[k], Z[k]);
+            multiply(Z[k], w);
+            for(int j = 0; j <= k; j++){
+                double h = 0.;
+                for(int i = 0; i < n; i++)
+                    h += w[i] * V[j][i];
+                for(int i = 0; i < n; i++)
+                    w[i] -= h * V[j][i];
+                H[j*m + k] = h;
+            }
+            double hn = 0.;
+            for(int i = 0; i < n; i++)
+                hn += w[i] * w[i];
+            hn = sqrt(hn);
+            H[(k+1)*m + k] = hn;
+            if(hn > 0.)
+                for(int i = 0; i < n; i++)
+                    V[k+1][i] = w[i] / hn;
+            for(int j = 0; j < k; j++){
+                double t = cs[j] * H[j*m + k] + sn[j] * H[(j+1)*m + k];
+                H[(j+1)*m + k] = -sn[j] * H[j*m + k] + cs[j] * H[(j+1)*m + k];
+                H[j*m + k] = t;
+            }
+            double d = sqrt(H[k*m + k] * H[k*m + k] + hn * hn);
+            cs[k] = (d > 0.) ? H[k*m + k] / d : 1.;
+            sn[k] = (d > 0.) ? hn / d : 0.;
+            H[k*m + k] = d;
+            H[(k+1)*m + k] = 0.;
+            g[k+1] = -sn[k] * g[k];
+            g[k] = cs[k] * g[k];
+            its++;
+            k++;
+            res = fabs(g[k]);
+            breakdown = !(hn > 0.) || !(d > 0.);
+            if(res <= tol || breakdown)
+                break;
+        }
+        for(int j = k - 1; j >= 0; j--){
+            y[j] = g[j];
+            for(int l = j + 1; l < k; l++)
+                y[j] -= H[j*m + l] * y[l];
+            y[j] = (H[j*m + j] != 0.) ? y[j] / H[j*m + j] : 0.;
+        }
+        for(int j = 0; j < k; j++)
+            for(int i = 0; i < n; i++)
+                xv[i] += y[j] * Z[j][i];
+        multiply(xv, r);
+        beta = 0.;
+        for(int i = 0; i < n; i++){
+            r[i] = b[beg + i] - r[i];
+            beta += r[i] * r[i];
+        }
+        beta = sqrt(beta);
+        res = beta;
+    }
+    for(int i = 0; i < n; i++)
+        x[beg + i] = xv[i];
+    itsHead += itsP;
+    bool ok = (res <= tol);
+    reason = ok ? "converged" : (its >= maxIts ? "maximum iterations reached" : "FGMRES breakdown or divergence");
+    return ok;
+}
+
+// =====================================================
+
+// Acceleration of splitting iterations x = G(x) in the sequential scheme,
+// x is (head, concentration) of all cells, G is one flow + transport pass.
+// Anderson mixing of depth andersonDepth or Aitken dynamic relaxation;
+// Aitken is also used when the Anderson least squares problem is singular.
+class SplittingAcceleration
+{
+private:
+    vector<double> fPrev, gPrev;   // residual G(x)-x and G(x) of last iteration
+    vector< vector<double> > dF, dG; // Anderson history of their differences
+    double omega;                  // Aitken relaxation
+    bool first;
+    void aitken(const vector<double> &x, const vector<double> &f, vector<double> &g);
+public:
+    SplittingAcceleration() : omega(1.), first(true) {}
+    // Call at the start of every time step
+    void reset() { dF.clear(); dG.clear(); omega = 1.; first = true; }
+    // x - input of the splitting iteration, g = G(x) on entry,
+    // next iterate on exit
+    void update(const vector<double> &x, vector<double> &g);
+};
+
+void SplittingAcceleration::aitken(const vector<double> &x, const vector<double> &f, vector<double> &g)
+{
+    if(!first){
+        double num = 0., den = 0.;
+        for(size_t i = 0; i < f.size(); i++){
+            num += fPrev[i] * (f[i] - fPrev[i]);
+            den += (f[i] - fPrev[i]) * (f[i] - fPrev[i]);
+        }
+        if(den > 0.)
+            omega = min(aitkenMax, max(aitkenMin, -omega * num / den));
+    }
+    for(size_t i = 0; i < g.size(); i++)
+        g[i] = x[i] + omega * f[i];
+}
+
+void SplittingAcceleration::update(const vector<double> &x, vector<double> &g)
+{
+    vector<double> f(g.size());
+    for(size_t i = 0; i < g.size(); i++)
+        f[i] = g[i] - x[i];
+    vector<double> gk = g;
+
+    if(splitAccel == ACCEL_AITKEN)
+        aitken(x, f, g);
+    else if(splitAccel == ACCEL_ANDERSON && !first){
+        dF.push_back(f);
+        dG.push_back(gk);
+        for(size_t i = 0; i < f.size(); i++){
+            dF.back()[i] -= fPrev[i];
+            dG.back()[i] -= gPrev[i];
+        }
+        if(static_cast<int>(dF.size()) > andersonDepth){
+            dF.erase(dF.begin());
+            dG.erase(dG.begin());
+        }
+        // gamma = argmin |f - dF gamma|, normal equations
+        int mk = static_cast<int>(dF.size());
+        rMatrix A(mk, mk), b(mk, 1);
+        for(int j = 0; j < mk; j++){
+            b(j,0) = 0.;
+            for(size_t i = 0; i < f.size(); i++)
+                b(j,0) += dF[j][i] * f[i];
+            for(int l = 0; l < mk; l++){
+                A(j,l) = 0.;
+                for(size_t i = 0; i < f.size(); i++)
+                    A(j,l) += dF[j][i] * dF[l][i];
+            }
+        }
+        int ierr = 0;
+        rMatrix Ainv = A.Invert(&ierr);
+        if(ierr){
+            cout << "Anderson: singular history, Aitken step" << endl;
+            dF.clear();
+            dG.clear();
+            aitken(x, f, g);
+        }
+        else{
+            rMatrix gamma = Ainv * b;
+            for(int j = 0; j < mk; j++)
+                for(size_t i = 0; i < g.size(); i++)
+                    g[i] -= gamma(j,0) * dG[j][i];
+        }
+    }
+    fPrev = f;
+    gPrev = gk;
+    first = false;
+}
+
+// =====================================================
+
+// Solution output with cadence control (-out_every, -out_dt).
+// Default format is a ParaView collection <prefix>.pvd referencing binary
+// VTU files <prefix>_<n>.vtu with appended raw data (little endian) that
+// contain only the selected cell fields (-out_fields). Geometry arrays
+// are built once and copied to every file. -out vtk keeps the old
+// behavior: whole mesh with all tags in <prefix><n>.vtk
+// With outAsync the time loop only copies field values to a snapshot,
+// files are serialized by a writer thread while the next step computes.
+// At most outQueue snapshots wait or are being written (backpressure).
+struct OutputJob
+{
+    string name;
+    double T;
+    vector< vector<double> > data; // values of each field by cell
+};
+
+class OutputWriter
+{
+private:
+    Mesh *m;
+    vector<Tag> fields;
+    vector<double> points;               // geometry cache
+    vector<int> conn, offs;
+    vector<unsigned char> types;
+    vector< pair<double,string> > files; // time and file name, used by the writer
+    double nextT;
+    int nFiles;
+    // Writer thread
+    thread worker;
+    mutex mtx;
+    condition_variable cv;
+    deque<OutputJob> jobs;
+    size_t busy;                         // jobs taken by the writer, not finished
+    bool stop;
+    void buildGeometry();
+    void serialize(const OutputJob &job);
+    void writeVTU(const OutputJob &job);
+    void writePVD();
+    void run();
+public:
+    double tIO;     // time spent by the time loop
+    double tWriter; // time spent by the writer thread
+    OutputWriter(Mesh *mm);
+    ~OutputWriter();
+    // Writes if the step is due; always writes at the final time
+    void stepDone(int step, double T);
+    void write(int step, double T);
+    void finish(); // wait until all files are written
+    void meshChanged();
+    // File list and cadence for checkpoints, call after finish()
+    void saveState(ofstream &f) const;
+    void loadState(ifstream &f);
+};
+
+template<class Type>
+void writeBin(ofstream &f, const Type &v)
+{
+    f.write(reinterpret_cast<const char*>(&v), sizeof(Type));
+}
+
+template<class Type>
+void readBin(ifstream &f, Type &v)
+{
+    f.read(reinterpret_cast<char*>(&v), sizeof(Type));
+}
+
+OutputWriter::OutputWriter(Mesh *mm) : m(mm), nextT(0.), nFiles(0), busy(0), stop(false), tIO(0.), tWriter(0.)
+{
+    if(outLegacy)
+        return;
+    string list = outFields + ",";
+    size_t b = 0, e;
+    while((e = list.find(',', b)) != string::npos){
+        string name = list.substr(b, e - b);
+        b = e + 1;
+        if(name.empty())
+            continue;
+        if(!m->HaveTag(name)){
+            cout << "Output: no tag " << name << ", skipped" << endl;
+            continue;
+        }
+        Tag tag = m->GetTag(name);
+        if(!tag.isDefined(CELL) || tag.GetDataType() != DATA_REAL || tag.GetSize() == ENUMUNDEF){
+            cout << "Output: " << name << " is not a fixed size real cell tag, skipped" << endl;
+            continue;
+        }
+        fields.push_back(tag);
+    }
+    buildGeometry();
+    if(outAsync)
+        worker = thread(&OutputWriter::run, this);
+}
+
+OutputWriter::~OutputWriter()
+{
+    if(worker.joinable()){
+        {
+            lock_guard<mutex> lock(mtx);
+            stop = true;
+        }
+        cv.notify_all();
+        worker.join();
+    }
+}
+
+void OutputWriter::finish()
+{
+    double t = Timer();
+    unique_lock<mutex> lock(mtx);
+    cv.wait(lock, [this]{ return jobs.empty() && busy == 0; });
+    tIO += Timer() - t;
+}
+
+void OutputWriter::run()
+{
+    for(;;){
+        OutputJob job;
+        {
+            unique_lock<mutex> lock(mtx);
+            cv.wait(lock, [this]{ return stop || !jobs.empty(); });
+            if(jobs.empty())
+                return;
+            job = move(jobs.front());
+            jobs.pop_front();
+            busy++;
+        }
+        double t = Timer();
+        serialize(job);
+        tWriter += Timer() - t;
+        {
+            lock_guard<mutex> lock(mtx);
+            busy--;
+        }
+        cv.notify_all();
+    }
+}
+
+void OutputWriter::buildGeometry()
+{
+    vector<int> nodeIdx(m->NodeLastLocalID(), -1);
+    int np = 0;
+    for(auto inode = m->BeginNode(); inode != m->EndNode(); inode++){
+        nodeIdx[inode->LocalID()] = np++;
+        Storage::real_array x = inode->Coords();
+        for(unsigned d = 0; d < 3; d++)
+            points.push_back(d < x.size() ? x[d] : 0.);
+    }
+    for(auto icell = m->BeginCell(); icell != m->EndCell(); icell++){
+        ElementArray<Node> nodes = icell->getNodes();
+        for(unsigned k = 0; k < nodes.size(); k++)
+            conn.push_back(nodeIdx[nodes[k].LocalID()]);
+        offs.push_back(static_cast<int>(conn.size()));
+        types.push_back(7); // VTK_POLYGON
+    }
+}
+
+// Geometry cache is rebuilt after mesh adaptation, pending files
+// are written first as the writer thread reads the cache
+void OutputWriter::meshChanged()
+{
+    if(outLegacy)
+        return;
+    finish();
+    points.clear();
+    conn.clear();
+    offs.clear();
+    types.clear();
+    buildGeometry();
+}
+
+void OutputWriter::stepDone(int step, double T)
+{
+    bool last = !(Tfinal - T > 1e-10*Tfinal);
+    bool due = (outEvery > 0 && step % outEvery == 0);
+    if(outDt > 0. && T >= nextT - 1e-10*outDt)
+        due = true;
+    if(due || last)
+        write(step, T);
+}
+
+void OutputWriter::write(int step, double T)
+{
+    double t = Timer();
+    if(outDt > 0.)
+        while(nextT <= T + 1e-10*outDt)
+            nextT += outDt;
+    if(outLegacy){
+        m->Save(outPrefix + to_string(step) + ".vtk");
+        tIO += Timer() - t;
+        return;
+    }
+    OutputJob job;
+    job.name = outPrefix + "_" + to_string(nFiles++) + ".vtu";
+    job.T = T;
+    job.data.resize(fields.size());
+    for(size_t i = 0; i < fields.size(); i++){
+        job.data[i].reserve(types.size() * fields[i].GetSize());
+        for(auto icell = m->BeginCell(); icell != m->EndCell(); icell++){
+            Storage::real_array v = icell->RealArray(fields[i]);
+            job.data[i].insert(job.data[i].end(), v.begin(), v.end());
+        }
+    }
+    if(!outAsync)
+        serialize(job);
+    else{
+        unique_lock<mutex> lock(mtx);
+        cv.wait(lock, [this]{ return jobs.size() + busy < outQueue; });
+        jobs.push_back(move(job));
+        lock.unlock();
+        cv.notify_all();
+    }
+    tIO += Timer() - t;
+}
+
+void OutputWriter::serialize(const OutputJob &job)
+{
+    writeVTU(job);
+    files.push_back(make_pair(job.T, job.name));
+    writePVD();
+}
+
+// Uses only the snapshot and geometry cache, not the mesh
+void OutputWriter::writeVTU(const OutputJob &job)
+{
+    const string &name = job.name;
+    ofstream out(name.c_str(), ios::binary);
+    if(!out){
+        cout << "Cannot open " << name << endl;
+        return;
+    }
+    int np = static_cast<int>(points.size() / 3), nc = static_cast<int>(types.size());
+    // Sizes of appended blocks, each is preceded by its UInt32 byte count
+    vector<unsigned> sizes;
+    sizes.push_back(static_cast<unsigned>(points.size() * sizeof(double)));
+    sizes.push_back(static_cast<unsigned>(conn.size() * sizeof(int)));
+    sizes.push_back(static_cast<unsigned>(offs.size() * sizeof(int)));
+    sizes.push_back(static_cast<unsigned>(types.size()));
+    for(auto &tag : fields)
+        sizes.push_back(static_cast<unsigned>(nc * tag.GetSize() * sizeof(double)));
+    vector<unsigned> offsets(sizes.size(), 0);
+    for(size_t i = 1; i < sizes.size(); i++)
+        offsets[i] = offsets[i-1] + sizeof(unsigned) + sizes[i-1];
+
+    out << "<?xml version=\"1.0\"?>\n";
+    out << "<VTKFile type=\"UnstructuredGrid\" version=\"0.1\" byte_order=\"LittleEndian\" header_type=\"UInt32\">\n";
+    out << "<UnstructuredGrid>\n";
+    out << "<Piece NumberOfPoints=\"" << np << "\" NumberOfCells=\"" << nc << "\">\n";
+    out << "<Points>\n<DataArray type=\"Float64\" NumberOfComponents=\"3\" format=\"appended\" offset=\"" << offsets[0] << "\"/>\n</Points>\n";
+    out << "<Cells>\n";
+    out << "<DataArray type=\"Int32\" Name=\"connectivity\" format=\"appended\" offset=\"" << offsets[1] << "\"/>\n";
+    out << "<DataArray type=\"Int32\" Name=\"offsets\" format=\"appended\" offset=\"" << offsets[2] << "\"/>\n";
+    out << "<DataArray type=\"UInt8\" Name=\"types\" format=\"appended\" offset=\"" << offsets[3] << "\"/>\n";
+    out << "</Cells>\n<CellData>\n";
+    for(size_t i = 0; i < fields.size(); i++)
+        out << "<DataArray type=\"Float64\" Name=\"" << fields[i].GetTagName() << "\" NumberOfComponents=\""
+            << fields[i].GetSize() << "\" format=\"appended\" offset=\"" << offsets[4 + i] << "\"/>\n";
+    out << "</CellData>\n</Piece>\n</UnstructuredGrid>\n";
+    out << "<AppendedData encoding=\"raw\">\n_";
+    out.write(reinterpret_cast<const char*>(&sizes[0]), sizeof(unsigned));
+    out.write(reinterpret_cast<const char*>(points.data()), sizes[0]);
+    out.write(reinterpret_cast<const char*>(&sizes[1]), sizeof(unsigned));
+    out.write(reinterpret_cast<const char*>(conn.data()), sizes[1]);
+    out.write(reinterpret_cast<const char*>(&sizes[2]), sizeof(unsigned));
+    out.write(reinterpret_cast<const char*>(offs.data()), sizes[2]);
+    out.write(reinterpret_cast<const char*>(&sizes[3]), sizeof(unsigned));
+    out.write(reinterpret_cast<const char*>(types.data()), sizes[3]);
+    for(size_t i = 0; i < fields.size(); i++){
+        out.write(reinterpret_cast<const char*>(&sizes[4 + i]), sizeof(unsigned));
+        out.write(reinterpret_cast<const char*>(job.data[i].data()), sizes[4 + i]);
+    }
+    out << "\n</AppendedData>\n</VTKFile>\n";
+}
+
+void OutputWriter::saveState(ofstream &f) const
+{
+    writeBin(f, nextT);
+    writeBin(f, nFiles);
+    int n = static_cast<int>(files.size());
+    writeBin(f, n);
+    for(auto &e : files){
+        int len = static_cast<int>(e.second.size());
+        writeBin(f, e.first);
+        writeBin(f, len);
+        f.write(e.second.data(), len);
+    }
+}
+
+void OutputWriter::loadState(ifstream &f)
+{
+    int n = 0;
+    readBin(f, nextT);
+    readBin(f, nFiles);
+    readBin(f, n);
+    files.resize(n);
+    for(auto &e : files){
+        int len = 0;
+        readBin(f, e.first);
+        readBin(f, len);
+        e.second.resize(len);
+        f.read(&e.second[0], len);
+    }
+}
+
+// Rewritten after every file, so that it is valid if the run stops
+void OutputWriter::writePVD()
+{
+    ofstream out((outPrefix + ".pvd").c_str());
+    out << "<?xml version=\"1.0\"?>\n";
+    out.precision(15);
+    out << "<VTKFile type=\"Collection\" version=\"0.1\">\n<Collection>\n";
+    for(auto &f : files)
+        out << "<DataSet timestep=\"" << f.first << "\" file=\"" << f.second << "\"/>\n";
+    out << "</Collection>\n</VTKFile>\n";
+}
+
+// =====================================================
+
+// Time loop state kept in checkpoints besides cell values
+struct RunState
+{
+    int method;        // 0 - fim, 1 - sim, 2 - impes
+    double T;
+    int nsteps, nrej;
+    int newtit, nspl, linit, linitRef; // nspl - transport substeps for impes
+    double itsSaved[2];
+};
+
+// =====================================================
+
 class Problem
 {
 private:
@@ -445,7 +1838,15 @@ private:
     Tag tagConc;
     Tag tagHeadPrev;
     Tag tagConcPrev;
+    Tag tagHeadPrev2;
+    Tag tagConcPrev2;
     Tag tagWatFlux;
+    Tag tagDens;
+    Tag tagHist; // AMR: refinement family ids from the coarsest ancestor
+
+    vector<double> iterH, iterC; // Newton iterate before update, by cell local ID
+    map<int,int> amrFamily;      // family id -> number of children
+    int amrNextFamily;
 
     double times[10];
     double ttt; // global timer
@@ -460,12 +1861,40 @@ public:
     void testDiffusion();
     void runSimulationFIM();
     void runSimulationSIM();
+    void runSimulationIMPES();
+    void setInitialState();
+    void rejectStep();
+    void saveIterate();
+    void getState(vector<double> &x);
+    void setState(const vector<double> &x);
+    template<class LinSolver>
+    bool solveLinear(LinSolver &S, PreconditionerReuse &pc, Residual &R, Sparse::Vector &sol);
+    void applyNewtonUpdate(Sparse::Vector &sol, dynamic_variable &varH, dynamic_variable &varC,
+                           double w, bool updH, bool updC);
+    void acceptStep(double dtDone);
+    double maxConcChange();
+    double nextTimeStep(double T, int nwtIt, int linIt);
     void saveSolution(string path); // save mesh with solution
+    void saveCheckpoint(const RunState &rs, OutputWriter &out);
+    void loadCheckpoint(RunState &rs, OutputWriter &out);
+    // Mesh adaptation
+    int cellLevel(const Cell &c) const;
+    double concJump(const Cell &c) const;
+    vector<Tag> transferTags() const;
+    void copyCellData(const Cell &from, const Cell &to);
+    Face segment(const Node &a, const Node &b);
+    void replaceFace(Cell c, const Face &f, const Face &f1, const Face &f2,
+                     MarkerType changed, MarkerType mrkRef, vector<HandleType> &work);
+    void refineCell(Cell c, MarkerType changed, MarkerType mrkRef, vector<HandleType> &work);
+    void coarsenFamily(const vector<HandleType> &fam, MarkerType changed);
+    void mergeFaces(const Cell &p);
+    bool adaptMesh(MarkerType changed);
 };
 
 Problem::Problem(string meshName)
 {
     ttt = Timer();
+    amrNextFamily = 0;
     for(int i = 0; i < 10; i++)
         times[i] = 0.;
 
@@ -488,6 +1917,8 @@ Problem::~Problem()
     printf("| T_IO       = %lf\n", times[T_IO]);
     printf("| T_update   = %lf\n", times[T_UPDATE]);
     printf("| T_init     = %lf\n", times[T_INIT]);
+    if(useAMR)
+        printf("| T_adapt    = %lf\n", times[T_ADAPT]);
     printf("+-------------------------\n");
     printf("| T_total    = %lf\n", Timer() - ttt);
     printf("+=========================\n");
@@ -501,7 +1932,10 @@ void Problem::initProblem()
     tagConc = m.CreateTag(tagNameConc, DATA_REAL, CELL, NONE, 1);
     tagHeadPrev = m.CreateTag(tagNameHeadPrev, DATA_REAL, CELL, NONE, 1);
     tagConcPrev = m.CreateTag(tagNameConcPrev, DATA_REAL, CELL, NONE, 1);
+    tagHeadPrev2 = m.CreateTag(tagNameHeadPrev2, DATA_REAL, CELL, NONE, 1);
+    tagConcPrev2 = m.CreateTag(tagNameConcPrev2, DATA_REAL, CELL, NONE, 1);
     tagWatFlux  = m.CreateTag(tagNameWatFlux, DATA_VARIABLE, FACE, NONE, 2);
+    tagHist     = m.CreateTag(tagNameAMRHist, DATA_INTEGER, CELL, NONE);
 
     // Create scalar tensor tag
     tagK = m.CreateTag(tagNameTensorK, DATA_REAL, CELL, NONE, 3);
@@ -537,27 +1971,610 @@ void Problem::initProblem()
         }
     }
 
-    times[T_INIT] += Timer() - t;
-    m.Save("init.vtk");
+    times[T_INIT] += Timer() - t;
+    if(outLegacy)
+        m.Save("init.vtk");
+}
+
+void Problem::assembleGlobalSystem()
+{
+    double t = Timer();
+    times[T_ASSEMBLE] += Timer() - t;
+}
+
+void Problem::solveSystem()
+{
+    double t = Timer();
+    times[T_UPDATE] += Timer() - t;
+}
+
+void Problem::saveSolution(string path)
+{
+    double t = Timer();
+    m.Save(path);
+    times[T_IO] += Timer() - t;
+}
+
+void Problem::setInitialState()
+{
+    tagDens = m.CreateTag("Density", DATA_REAL, CELL, NONE, 1);
+    for(auto icell = m.BeginCell(); icell != m.EndCell(); icell++){
+        Cell c = icell->getAsCell();
+        double x[2];
+        c.Barycenter(x);
+        double r2 = (x[0]-0.5)*(x[0]-0.5) + (x[1]-0.5)*(x[1]-0.5);
+        if(r2 < 0.01){
+            c.Real(tagHead) = 0.;
+            c.Real(tagConc) = 1.;
+        }
+        else{
+            c.Real(tagHead) = 0.;
+            c.Real(tagConc) = 0.;
+        }
+        c.Real(tagHeadPrev) = c.Real(tagHead);
+        c.Real(tagConcPrev) = c.Real(tagConc);
+        c.Real(tagHeadPrev2) = c.Real(tagHead);
+        c.Real(tagConcPrev2) = c.Real(tagConc);
+        c.Real(tagDens)     = density(c.Real(tagConc)).GetValue();
+    }
+    dtPrev = 0.;
+}
+
+const char chkMagic[8] = {'D','D','F','C','H','K','1','\0'};
+
+// Cell values of all time levels, dt controller state, counters
+// and output state. Written to a temporary file first, so that
+// the previous checkpoint survives if the run is killed while writing
+void Problem::saveCheckpoint(const RunState &rs, OutputWriter &out)
+{
+    double t = Timer();
+    string name = chkPrefix + ".chk", tmp = name + ".tmp";
+    ofstream f(tmp.c_str(), ios::binary);
+    if(!f){
+        cout << "Cannot open " << tmp << endl;
+        return;
+    }
+    int ncells = m.NumberOfCells();
+    f.write(chkMagic, sizeof(chkMagic));
+    writeBin(f, ncells);
+    writeBin(f, rs);
+    writeBin(f, dt);
+    writeBin(f, dtPrev);
+    out.finish();
+    out.saveState(f);
+    Tag tags[7] = {tagHead, tagConc, tagHeadPrev, tagConcPrev, tagHeadPrev2, tagConcPrev2, tagDens};
+    for(int i = 0; i < 7; i++)
+        for(auto icell = m.BeginCell(); icell != m.EndCell(); icell++)
+            writeBin(f, icell->Real(tags[i]));
+    f.close();
+    if(!f || rename(tmp.c_str(), name.c_str()) != 0)
+        cout << "Failed to write checkpoint " << name << endl;
+    else
+        cout << "Checkpoint " << name << " at T = " << rs.T << endl;
+    times[T_IO] += Timer() - t;
+}
+
+// Mesh has to be the same as in the checkpointed run
+void Problem::loadCheckpoint(RunState &rs, OutputWriter &out)
+{
+    double t = Timer();
+    ifstream f(restartFile.c_str(), ios::binary);
+    char magic[8];
+    int ncells = -1, method = rs.method;
+    f.read(magic, sizeof(magic));
+    readBin(f, ncells);
+    if(!f || !equal(magic, magic + 8, chkMagic)){
+        cout << "Bad checkpoint file " << restartFile << endl;
+        exit(1);
+    }
+    if(ncells != m.NumberOfCells()){
+        cout << "Checkpoint has " << ncells << " cells, mesh has " << m.NumberOfCells() << endl;
+        exit(1);
+    }
+    readBin(f, rs);
+    if(rs.method != method){
+        cout << "Checkpoint was written by the other method" << endl;
+        exit(1);
+    }
+    readBin(f, dt);
+    readBin(f, dtPrev);
+    out.loadState(f);
+    Tag tags[7] = {tagHead, tagConc, tagHeadPrev, tagConcPrev, tagHeadPrev2, tagConcPrev2, tagDens};
+    for(int i = 0; i < 7; i++)
+        for(auto icell = m.BeginCell(); icell != m.EndCell(); icell++)
+            readBin(f, icell->Real(tags[i]));
+    if(!f){
+        cout << "Checkpoint file " << restartFile << " is truncated" << endl;
+        exit(1);
+    }
+    cout << "Restart from " << restartFile << " at T = " << rs.T << ", step " << rs.nsteps << endl;
+    times[T_IO] += Timer() - t;
+}
+
+// Shift time levels after an accepted step of size dtDone
+void Problem::acceptStep(double dtDone)
+{
+    for(auto icell = m.BeginCell(); icell != m.EndCell(); icell++){
+        Cell c = icell->getAsCell();
+        c.Real(tagHeadPrev2) = c.Real(tagHeadPrev);
+        c.Real(tagConcPrev2) = c.Real(tagConcPrev);
+        c.Real(tagHeadPrev)  = c.Real(tagHead);
+        c.Real(tagConcPrev)  = c.Real(tagConc);
+    }
+    dtPrev = dtDone;
+}
+
+// Restore state from the beginning of the time step and cut dt
+void Problem::rejectStep()
+{
+    for(auto icell = m.BeginCell(); icell != m.EndCell(); icell++){
+        Cell c = icell->getAsCell();
+        c.Real(tagHead) = c.Real(tagHeadPrev);
+        c.Real(tagConc) = c.Real(tagConcPrev);
+        c.Real(tagDens) = density(c.Real(tagConc)).GetValue();
+    }
+    dt *= dtCut;
+    cout << "Step rejected, dt = " << dt << endl;
+    if(dt < dtMin){
+        cout << "Time step below dt_min = " << dtMin << ", stopping" << endl;
+        exit(1);
+    }
+}
+
+// Solve with preconditioner reuse, retry with a new preconditioner
+// if the stale one failed
+template<class LinSolver>
+bool Problem::solveLinear(LinSolver &S, PreconditionerReuse &pc, Residual &R, Sparse::Vector &sol)
+{
+    double t = Timer();
+    pc.setMatrix(S, R.GetJacobian());
+    times[T_PRECOND] += Timer() - t;
+    t = Timer();
+    bool solved = S.Solve(R.GetResidual(), sol);
+    if(!solved && pc.isStale()){
+        cout << "Retry with new preconditioner" << endl;
+        pc.setMatrix(S, R.GetJacobian(), true);
+        solved = S.Solve(R.GetResidual(), sol);
+    }
+    times[T_SOLVE] += Timer() - t;
+    pc.update(S.Iterations());
+    return solved;
+}
+
+// x = (head, concentration) of all cells
+void Problem::getState(vector<double> &x)
+{
+    int n = m.NumberOfCells(), k = 0;
+    x.resize(2*n);
+    for(auto icell = m.BeginCell(); icell != m.EndCell(); icell++, k++){
+        x[k]     = icell->Real(tagHead);
+        x[n + k] = icell->Real(tagConc);
+    }
+}
+
+void Problem::setState(const vector<double> &x)
+{
+    int n = m.NumberOfCells(), k = 0;
+    for(auto icell = m.BeginCell(); icell != m.EndCell(); icell++, k++){
+        Cell c = icell->getAsCell();
+        c.Real(tagHead) = x[k];
+        c.Real(tagConc) = max(0., min(1., x[n + k]));
+        c.Real(tagDens) = density(c.Real(tagConc)).GetValue();
+    }
+}
+
+// Remember current Newton iterate, updates are applied to it
+void Problem::saveIterate()
+{
+    iterH.resize(m.CellLastLocalID());
+    iterC.resize(m.CellLastLocalID());
+    for(auto icell = m.BeginCell(); icell != m.EndCell(); icell++){
+        Cell c = icell->getAsCell();
+        iterH[c.LocalID()] = c.Real(tagHead);
+        iterC[c.LocalID()] = c.Real(tagConc);
+    }
+}
+
+// Iterate = saved iterate - w*sol, chopped if requested
+void Problem::applyNewtonUpdate(Sparse::Vector &sol, dynamic_variable &varH, dynamic_variable &varC,
+                                double w, bool updH, bool updC)
+{
+    for(auto icell = m.BeginCell(); icell != m.EndCell(); icell++){
+        Cell c = icell->getAsCell();
+        int k = c.LocalID();
+        if(updH){
+            double dH = -w*sol[varH.Index(c)];
+            if(chopping)
+                dH = max(-dHMax, min(dHMax, dH));
+            c.Real(tagHead) = iterH[k] + dH;
+        }
+        if(updC){
+            double dC = -w*sol[varC.Index(c)];
+            if(chopping){
+                dC = max(-dCMax, min(dCMax, dC));
+                dC = max(-iterC[k], min(1. - iterC[k], dC));
+            }
+            c.Real(tagConc) = iterC[k] + dC;
+            c.Real(tagDens) = density(c.Real(tagConc)).GetValue();
+        }
+    }
+}
+
+double Problem::maxConcChange()
+{
+    double dC = 0.;
+    for(auto icell = m.BeginCell(); icell != m.EndCell(); icell++){
+        Cell c = icell->getAsCell();
+        dC = max(dC, fabs(c.Real(tagConc) - c.Real(tagConcPrev)));
+    }
+    return dC;
+}
+
+// Step size after an accepted step at time T (end of the step)
+// based on Newton and linear iterations and concentration change
+double Problem::nextTimeStep(double T, int nwtIt, int linIt)
+{
+    double fac = 1.;
+    if(nwtIt <= nwtGoodIt && linIt <= linBadIt)
+        fac = dtGrow;
+    else if(nwtIt > nwtBadIt || linIt > linBadIt)
+        fac = dtShrink;
+    double dC = maxConcChange();
+    if(dC > 0.)
+        fac = min(fac, max(dtChangeCut, dCTarget / dC));
+
+    double dtNew = min(dtMax, max(dtMin, dt * fac));
+    // Do not step over final time, avoid a tiny last step
+    double rem = Tfinal - T;
+    if(rem < 1.5*dtNew)
+        dtNew = (rem > dtMax) ? 0.5*rem : rem;
+    return dtNew;
+}
+
+// =====================================================
+// Mesh adaptation. A cell is split by segments from its barycenter
+// to midpoints of its sides, one child per corner. Children of one split
+// form a family and are united back when the front has passed.
+// Size of AMR_HISTORY of a cell is its refinement level
+
+// x is a corner of the polyline p-x-n unless the nodes are collinear
+bool isCorner(const Node &p, const Node &x, const Node &n)
+{
+    Storage::real_array a = p.Coords(), b = x.Coords(), c = n.Coords();
+    double ax = b[0] - a[0], ay = b[1] - a[1], bx = c[0] - b[0], by = c[1] - b[1];
+    return fabs(ax*by - ay*bx) > 1e-8 * sqrt((ax*ax + ay*ay)*(bx*bx + by*by));
+}
+
+int Problem::cellLevel(const Cell &c) const
+{
+    return static_cast<int>(c.IntegerArray(tagHist).size());
+}
+
+// Refinement indicator: largest concentration jump to a neighbour
+double Problem::concJump(const Cell &c) const
+{
+    double jump = 0.;
+    ElementArray<Face> faces = c.getFaces();
+    for(unsigned i = 0; i < faces.size(); i++){
+        Cell n = c.Neighbour(faces[i]);
+        if(n.isValid())
+            jump = max(jump, fabs(n.Real(tagConc) - c.Real(tagConc)));
+    }
+    return jump;
+}
+
+// Cell data moved to new cells: coefficients and all time levels
+vector<Tag> Problem::transferTags() const
+{
+    Tag tags[9] = {tagK, tagD, tagHead, tagConc, tagHeadPrev, tagConcPrev, tagHeadPrev2, tagConcPrev2, tagDens};
+    return vector<Tag>(tags, tags + 9);
+}
+
+// Children keep the values of the parent, so the mass
+// of every time level is conserved
+void Problem::copyCellData(const Cell &from, const Cell &to)
+{
+    vector<Tag> tags = transferTags();
+    for(size_t i = 0; i < tags.size(); i++){
+        Storage::real_array a = from.RealArray(tags[i]), b = to.RealArray(tags[i]);
+        for(unsigned k = 0; k < a.size(); k++)
+            b[k] = a[k];
+    }
+    Storage::integer_array h = from.IntegerArray(tagHist), g = to.IntegerArray(tagHist);
+    g.resize(h.size());
+    for(unsigned k = 0; k < h.size(); k++)
+        g[k] = h[k];
+}
+
+Face Problem::segment(const Node &a, const Node &b)
+{
+    ElementArray<Node> nodes(&m, 2);
+    nodes[0] = a;
+    nodes[1] = b;
+    return m.CreateFace(nodes).first;
+}
+
+// Cell c is replaced by the same polygon with face f split into f1, f2
+void Problem::replaceFace(Cell c, const Face &f, const Face &f1, const Face &f2,
+                          MarkerType changed, MarkerType mrkRef, vector<HandleType> &work)
+{
+    ElementArray<Face> faces = c.getFaces(), nf(&m);
+    for(unsigned i = 0; i < faces.size(); i++){
+        if(faces[i] != f)
+            nf.push_back(faces[i]);
+        else{
+            nf.push_back(f1);
+            nf.push_back(f2);
+        }
+    }
+    Cell n = m.CreateCell(nf).first;
+    copyCellData(c, n);
+    if(c.GetMarker(changed))
+        n.SetMarker(changed);
+    if(c.GetMarker(mrkRef)){
+        n.SetMarker(mrkRef);
+        work.push_back(n.GetHandle());
+    }
+    c.Delete();
+}
+
+// A side of the cell is the chain of faces between two corners.
+// A side of one face is split at its midpoint and the cell on the other
+// side is rebuilt with both halves; a side already split by a finer
+// neighbour is divided at its node closest to the midpoint
+void Problem::refineCell(Cell c, MarkerType changed, MarkerType mrkRef, vector<HandleType> &work)
+{
+    ElementArray<Node> nodes = c.getNodes();
+    ElementArray<Face> faces = c.getFaces();
+    unsigned nn = nodes.size();
+    vector<Face> seg(nn); // face between nodes k and k+1
+    for(unsigned k = 0; k < nn; k++){
+        for(unsigned i = 0; i < faces.size(); i++){
+            ElementArray<Node> fn = faces[i].getNodes();
+            if((fn[0] == nodes[k] && fn[1] == nodes[(k+1) % nn]) || (fn[1] == nodes[k] && fn[0] == nodes[(k+1) % nn]))
+                seg[k] = faces[i];
+        }
+    }
+    vector<unsigned> corners;
+    for(unsigned k = 0; k < nn; k++)
+        if(isCorner(nodes[(k+nn-1) % nn], nodes[k], nodes[(k+1) % nn]))
+            corners.push_back(k);
+    unsigned ns = corners.size();
+
+    vector<Node> mid(ns);
+    vector< vector<Face> > half1(ns), half2(ns); // corner to midpoint, midpoint to next corner
+    vector<Face> split;
+    for(unsigned s = 0; s < ns; s++){
+        unsigned k0 = corners[s], len = (corners[(s+1) % ns] + nn - k0) % nn;
+        Storage::real_array xa = nodes[k0].Coords(), xb = nodes[(k0+len) % nn].Coords();
+        double xm[3] = {0.5*(xa[0] + xb[0]), 0.5*(xa[1] + xb[1]), 0.};
+        if(len == 1){
+            Face f = seg[k0];
+            mid[s] = m.CreateNode(xm);
+            Face f1 = segment(nodes[k0], mid[s]), f2 = segment(mid[s], nodes[(k0+1) % nn]);
+            Tag bc[2] = {tagBCFlow, tagBCTran};
+            for(int t = 0; t < 2; t++){
+                if(!f.HaveData(bc[t]))
+                    continue;
+                for(int k = 0; k < 2; k++)
+                    f1.RealArray(bc[t])[k] = f2.RealArray(bc[t])[k] = f.RealArray(bc[t])[k];
+            }
+            Cell n = c.Neighbour(f);
+            if(n.isValid())
+                replaceFace(n, f, f1, f2, changed, mrkRef, work);
+            half1[s].push_back(f1);
+            half2[s].push_back(f2);
+            split.push_back(f);
+            continue;
+        }
+        unsigned j = 1;
+        double best = -1.;
+        for(unsigned i = 1; i < len; i++){
+            Storage::real_array x = nodes[(k0+i) % nn].Coords();
+            double d = (x[0] - xm[0])*(x[0] - xm[0]) + (x[1] - xm[1])*(x[1] - xm[1]);
+            if(best < 0. || d < best){
+                best = d;
+                j = i;
+            }
+        }
+        mid[s] = nodes[(k0+j) % nn];
+        for(unsigned i = 0; i < len; i++){
+            if(i < j)
+                half1[s].push_back(seg[(k0+i) % nn]);
+            else
+                half2[s].push_back(seg[(k0+i) % nn]);
+        }
+    }
+
+    double xc[3] = {0., 0., 0.};
+    c.Barycenter(xc);
+    Node center = m.CreateNode(xc);
+    vector<Face> inner(ns);
+    for(unsigned s = 0; s < ns; s++)
+        inner[s] = segment(center, mid[s]);
+
+    int id = amrNextFamily++;
+    amrFamily[id] = static_cast<int>(ns);
+    for(unsigned s = 0; s < ns; s++){
+        unsigned p = (s + ns - 1) % ns; // side ending at corner s
+        ElementArray<Face> cf(&m);
+        cf.push_back(inner[p]);
+        for(unsigned i = 0; i < half2[p].size(); i++)
+            cf.push_back(half2[p][i]);
+        for(unsigned i = 0; i < half1[s].size(); i++)
+            cf.push_back(half1[s][i]);
+        cf.push_back(inner[s]);
+        Cell child = m.CreateCell(cf).first;
+        copyCellData(c, child);
+        Storage::integer_array h = child.IntegerArray(tagHist);
+        h.resize(h.size() + 1);
+        h[h.size() - 1] = id;
+        child.SetMarker(changed);
+    }
+    c.Delete();
+    for(unsigned i = 0; i < split.size(); i++)
+        split[i].Delete();
 }
 
-void Problem::assembleGlobalSystem()
+// Children are united back into the parent, cell values are averaged
+// with volume weights (conservative for every time level)
+void Problem::coarsenFamily(const vector<HandleType> &fam, MarkerType changed)
 {
-    double t = Timer();
-    times[T_ASSEMBLE] += Timer() - t;
+    vector<Tag> tags = transferTags();
+    vector< vector<double> > avg(tags.size());
+    ElementArray<Cell> cells(&m);
+    double V = 0.;
+    for(size_t j = 0; j < fam.size(); j++){
+        Cell c(&m, fam[j]);
+        double v = c.Volume();
+        for(size_t i = 0; i < tags.size(); i++){
+            Storage::real_array a = c.RealArray(tags[i]);
+            avg[i].resize(a.size(), 0.);
+            for(unsigned k = 0; k < a.size(); k++)
+                avg[i][k] += v * a[k];
+        }
+        V += v;
+        cells.push_back(c);
+    }
+    Storage::integer_array h = cells[0].IntegerArray(tagHist);
+    vector<int> hist(h.begin(), h.end() - 1);
+    amrFamily.erase(h[h.size() - 1]);
+
+    // Barycenter node is the only node shared by all children
+    Node center;
+    ElementArray<Node> nodes = cells[0].getNodes();
+    for(unsigned k = 0; k < nodes.size(); k++){
+        ElementArray<Cell> nc = nodes[k].getCells();
+        bool inside = (nc.size() == fam.size());
+        for(unsigned i = 0; i < nc.size() && inside; i++)
+            inside = find(fam.begin(), fam.end(), nc[i].GetHandle()) != fam.end();
+        if(inside)
+            center = nodes[k];
+    }
+
+    Cell p = Cell::UniteCells(cells, 0);
+    for(size_t i = 0; i < tags.size(); i++){
+        Storage::real_array a = p.RealArray(tags[i]);
+        for(unsigned k = 0; k < a.size(); k++)
+            a[k] = avg[i][k] / V;
+    }
+    Storage::integer_array g = p.IntegerArray(tagHist);
+    g.resize(static_cast<unsigned>(hist.size()));
+    for(unsigned k = 0; k < hist.size(); k++)
+        g[k] = hist[k];
+    p.SetMarker(changed);
+    if(center.isValid() && !m.Hidden(center.GetHandle()) && center.getFaces().size() == 0)
+        center.Delete();
+    mergeFaces(p);
 }
 
-void Problem::solveSystem()
+// Two faces meeting at a hanging node of p are united when no other face
+// meets there, i.e. the neighbour on that side is not finer any more
+void Problem::mergeFaces(const Cell &p)
 {
-    double t = Timer();
-    times[T_UPDATE] += Timer() - t;
+    ElementArray<Node> nodes = p.getNodes();
+    for(unsigned k = 0; k < nodes.size(); k++){
+        ElementArray<Face> nf = nodes[k].getFaces();
+        if(nf.size() != 2)
+            continue;
+        ElementArray<Node> n0 = nf[0].getNodes(), n1 = nf[1].getNodes();
+        Node a = (n0[0] == nodes[k]) ? n0[1] : n0[0];
+        Node b = (n1[0] == nodes[k]) ? n1[1] : n1[0];
+        if(isCorner(a, nodes[k], b))
+            continue;
+        Tag bc[2] = {tagBCFlow, tagBCTran};
+        double val[2][2];
+        bool have[2];
+        for(int t = 0; t < 2; t++){
+            have[t] = nf[0].HaveData(bc[t]);
+            for(int i = 0; i < 2 && have[t]; i++)
+                val[t][i] = nf[0].RealArray(bc[t])[i];
+        }
+        Face f = Face::UniteFaces(nf, 0);
+        for(int t = 0; t < 2; t++)
+            for(int i = 0; i < 2 && have[t]; i++)
+                f.RealArray(bc[t])[i] = val[t][i];
+        if(!m.Hidden(nodes[k].GetHandle()) && nodes[k].getFaces().size() == 0)
+            nodes[k].Delete();
+    }
 }
 
-void Problem::saveSolution(string path)
+// Marks cells for refinement and complete families for coarsening,
+// then modifies the mesh. Cells with new geometry get marker changed.
+// Returns false if nothing was done
+bool Problem::adaptMesh(MarkerType changed)
 {
     double t = Timer();
-    m.Save(path);
-    times[T_IO] += Timer() - t;
+    MarkerType mrkRef = m.CreateMarker();
+    vector<HandleType> work;
+    for(auto icell = m.BeginCell(); icell != m.EndCell(); icell++){
+        Cell c = icell->getAsCell();
+        if(cellLevel(c) < amrMaxLevel && concJump(c) > amrRefine){
+            c.SetMarker(mrkRef);
+            work.push_back(c.GetHandle());
+        }
+    }
+    // Coarser neighbours of refined cells are refined too (2:1 balance)
+    for(size_t i = 0; i < work.size(); i++){
+        Cell c(&m, work[i]);
+        ElementArray<Face> faces = c.getFaces();
+        for(unsigned j = 0; j < faces.size(); j++){
+            Cell n = c.Neighbour(faces[j]);
+            if(n.isValid() && !n.GetMarker(mrkRef) && cellLevel(n) < cellLevel(c)){
+                n.SetMarker(mrkRef);
+                work.push_back(n.GetHandle());
+            }
+        }
+    }
+
+    // Families with all children present and smooth, without
+    // finer or refined neighbours
+    map<int, vector<HandleType> > fam;
+    for(auto icell = m.BeginCell(); icell != m.EndCell(); icell++){
+        Cell c = icell->getAsCell();
+        if(c.GetMarker(mrkRef) || cellLevel(c) == 0 || concJump(c) >= amrCoarsen)
+            continue;
+        Storage::integer_array h = c.IntegerArray(tagHist);
+        fam[h[h.size() - 1]].push_back(c.GetHandle());
+    }
+    vector< vector<HandleType> > unite;
+    for(auto it = fam.begin(); it != fam.end(); it++){
+        if(static_cast<int>(it->second.size()) != amrFamily[it->first])
+            continue;
+        bool ok = true;
+        for(size_t i = 0; i < it->second.size() && ok; i++){
+            Cell c(&m, it->second[i]);
+            ElementArray<Face> faces = c.getFaces();
+            for(unsigned j = 0; j < faces.size() && ok; j++){
+                Cell n = c.Neighbour(faces[j]);
+                ok = !n.isValid() || (!n.GetMarker(mrkRef) && cellLevel(n) <= cellLevel(c));
+            }
+        }
+        if(ok)
+            unite.push_back(it->second);
+    }
+
+    bool done = !(work.empty() && unite.empty());
+    int nref = 0;
+    if(done){
+        m.BeginModification();
+        for(size_t i = 0; i < unite.size(); i++)
+            coarsenFamily(unite[i], changed);
+        for(size_t i = 0; i < work.size(); i++){
+            if(m.Hidden(work[i])) // replaced by a neighbour split, see replaceFace
+                continue;
+            refineCell(Cell(&m, work[i]), changed, mrkRef, work);
+            nref++;
+        }
+        m.ResolveModification();
+        m.ApplyModification();
+        m.EndModification();
+        cout << "AMR: " << nref << " cells refined, " << unite.size() << " coarsened, "
+             << m.NumberOfCells() << " cells" << endl;
+    }
+    m.ReleaseMarker(mrkRef, CELL);
+    times[T_ADAPT] += Timer() - t;
+    return done;
 }
 
 void Problem::runSimulationFIM()
@@ -590,51 +2607,93 @@ void Problem::runSimulationFIM()
     S.SetParameter("relative_tolerance", "1e-12");
     S.SetParameter("absolute_tolerance", "1e-15");
     Sparse::Vector sol("sol", aut.GetFirstIndex(), aut.GetLastIndex());
+    Sparse::Vector solRef("solRef", aut.GetFirstIndex(), aut.GetLastIndex());
+    PreconditionerReuse pc;
+    ForcingTerm ew;
 
-    Tag tagDens = m.CreateTag("Density", DATA_REAL, CELL, NONE, 1);
-
-    for(auto icell = m.BeginCell(); icell != m.EndCell(); icell++){
-        Cell c = icell->getAsCell();
-        double x[2];
-        c.Barycenter(x);
-        double r2 = (x[0]-0.5)*(x[0]-0.5) + (x[1]-0.5)*(x[1]-0.5);
-        if(r2 < 0.01){
-            c.Real(tagHead) = 0.;
-            c.Real(tagConc) = 1.;
-        }
-        else{
-            c.Real(tagHead) = 0.;
-            c.Real(tagConc) = 0.;
+    CPRSolver cpr(cprPressure);
+    auto setCPRUnknowns = [&](){
+        vector<int> indCellH, indCellC;
+        for(auto icell = m.BeginCell(); icell != m.EndCell(); icell++){
+            indCellH.push_back(varH.Index(icell->self()));
+            indCellC.push_back(varC.Index(icell->self()));
         }
-        c.Real(tagHeadPrev) = c.Real(tagHead);
-        c.Real(tagConcPrev) = c.Real(tagConc);
-        c.Real(tagDens)     = density(c.Real(tagConc)).GetValue();
+        cpr.setUnknowns(indCellH, indCellC, aut.GetFirstIndex(), aut.GetLastIndex());
+    };
+    if(useCPR){
+        setCPRUnknowns();
+        cpr.SetParameter("relative_tolerance", "1e-12");
+        cpr.SetParameter("absolute_tolerance", "1e-15");
     }
+    int linitRef = 0;
+
+    setInitialState();
     times[T_INIT] += Timer() - t;
 
-    t = Timer();
-    m.Save("sol0.vtk");
-    times[T_IO] += Timer() - t;
+    OutputWriter out(&m);
 
-    int newtit = 0;
-    for(int it = 0; it < nt; it++){
-        cout << endl << "===== TIME STEP " << it << ", T = " << it*dt << " =====" << endl;
-        // Save old values
-        for(auto icell = m.BeginCell(); icell != m.EndCell(); icell++){
-            Cell c = icell->getAsCell();
-            c.Real(tagHeadPrev) = c.Real(tagHead);
-            c.Real(tagConcPrev) = c.Real(tagConc);
+    // Unknowns, systems and mesh dependent data are rebuilt after adaptation
+    auto remesh = [&]() -> bool {
+        MarkerType changed = m.CreateMarker();
+        bool done = adaptMesh(changed);
+        if(done){
+            double ta = Timer();
+            aut.EnumerateEntries();
+            R.SetInterval(aut.GetFirstIndex(), aut.GetLastIndex());
+            R.Clear();
+            sol.SetInterval(aut.GetFirstIndex(), aut.GetLastIndex());
+            solRef.SetInterval(aut.GetFirstIndex(), aut.GetLastIndex());
+            pFlow.meshChanged(changed);
+            pDiff.meshChanged(changed);
+            pAdv.meshChanged(changed);
+            pc.invalidate();
+            if(useCPR)
+                setCPRUnknowns();
+            out.meshChanged();
+            times[T_ADAPT] += Timer() - ta;
         }
+        m.ReleaseMarker(changed, CELL);
+        return done;
+    };
+    // Initial front is resolved by refining and setting the initial state again
+    if(useAMR && restartFile.empty())
+        for(int lev = 0; lev < amrMaxLevel && remesh(); lev++)
+            setInitialState();
+
+    int newtit = 0, nsteps = 0, nrej = 0;
+    double T = 0.;
+    RunState rs = {0, 0., 0, 0, 0, 0, 0, 0, {0., 0.}};
+    if(restartFile.empty())
+        out.write(0, 0.);
+    else{
+        loadCheckpoint(rs, out);
+        T = rs.T;
+        nsteps = rs.nsteps;
+        nrej = rs.nrej;
+        newtit = rs.newtit;
+        linit = rs.linit;
+        linitRef = rs.linitRef;
+        ew.itsSaved = rs.itsSaved[0];
+    }
+    while(Tfinal - T > 1e-10*Tfinal){
+        cout << endl << "===== TIME STEP " << nsteps << ", T = " << T << ", dt = " << dt << " =====" << endl;
+        // Old values are kept in Prev tags, shifted on acceptance
+        setTimeCoefficients();
+        pc.newTimeStep();
 
         // Newton loop
         bool converged = false;
+        int nit = 0, stepLinIt = 0;
+        double w = 1., normLS = 0.;
+        ew.reset();
         double norm2, norm2_0 = 0.0;
-        for(int nit = 0; nit < 100; nit++){
+        for(nit = 0; nit < nwtMaxIt; nit++){
             // Assemble residual
             t = Timer();
-            R.Clear();
+            clearValues(R);
             pFlow.fillResidual(R);
             pDiff.fillResidual(R);
+            pFlow.computeFluxes();
             pAdv.fillResidual(R);
             times[T_ASSEMBLE] += Timer() - t;
 
@@ -643,49 +2702,100 @@ void Problem::runSimulationFIM()
                 norm2_0 = norm2;
             cout << "it " << nit << ": |r|_2 = " << norm2 << endl;
 
+            // Backtrack if the update did not decrease the residual enough
+            if(lineSearch && nit > 0 && !(norm2 <= (1. - 1e-4*w)*normLS) && w > lsMinW){
+                w *= 0.5;
+                cout << "  line search: w = " << w << endl;
+                applyNewtonUpdate(sol, varH, varC, w, true, true);
+                continue;
+            }
+            if(norm2 != norm2)
+                break;
             if(norm2 < 1e-6 || norm2 < 1e-5*norm2_0){
                 converged = true;
                 break;
             }
 
-            t = Timer();
-            S.SetMatrix(R.GetJacobian());
+            ew.initialGuess(sol);
+            if(useCPR && linCompare){
+                // Reference solve with inner_ilu2, not timed
+                ew.applyTolerance(S);
+                solRef = sol;
+                S.SetMatrix(R.GetJacobian());
+                S.Solve(R.GetResidual(), solRef);
+                linitRef += S.Iterations();
+            }
+            if(useCPR)
+                ew.setTolerance(cpr, norm2, max(1e-6, 1e-5*norm2_0));
+            else
+                ew.setTolerance(S, norm2, max(1e-6, 1e-5*norm2_0));
             newtit++;
-            times[T_PRECOND] += Timer() - t;
             //R.GetJacobian().Save("J" + to_string(it+1) + ".mtx");
-            t = Timer();
-            bool solved = S.Solve(R.GetResidual(), sol);
-            times[T_SOLVE] += Timer() - t;
+            bool solved = useCPR ? solveLinear(cpr, pc, R, sol) : solveLinear(S, pc, R, sol);
+            int    its    = useCPR ? cpr.Iterations() : S.Iterations();
+            double linRes = useCPR ? cpr.Residual()   : S.Residual();
+            if(!solved && useCPR){
+                // Solve this system with inner_ilu2, CPR is rebuilt on the next iteration
+                cout << "CPR failed: " << cpr.GetReason() << ", retry with inner_ilu2" << endl;
+                pc.invalidate();
+                fill(sol.Begin(), sol.End(), 0.);
+                ew.applyTolerance(S);
+                S.SetMatrix(R.GetJacobian());
+                solved = S.Solve(R.GetResidual(), sol);
+                its += S.Iterations();
+                linRes = S.Residual();
+            }
+            ew.update(linRes, its);
+            linit += its;
+            stepLinIt = max(stepLinIt, its);
             if(!solved){
                 cout << "Linear solver failed: " << S.GetReason() << endl;
-                cout << "Residual: " << S.Residual() << endl;
-                exit(1);
+                cout << "Residual: " << linRes << endl;
+                break;
             }
-            //cout << "Linear solver iterations: " << S.Iterations() << endl;
-            linit += S.Iterations();
 
-            double w = 1;//0.125;
-            for(auto icell = m.BeginCell(); icell != m.EndCell(); icell++){
-                Cell c = icell->getAsCell();
-                c.Real(tagHead) -= w*sol[varH.Index(c)];
-                c.Real(tagConc) -= w*sol[varC.Index(c)];
-                c.Real(tagDens)  = density(c.Real(tagConc)).GetValue();
-            }
+            w = 1.;
+            normLS = norm2;
+            saveIterate();
+            applyNewtonUpdate(sol, varH, varC, w, true, true);
         }
         if(!converged){
             cout << "Newton failed" << endl;
-            exit(1);
+            nrej++;
+            rejectStep();
+            continue;
         }
 
-        string name = "sol" + to_string(it+1) + ".vtk";
-        t = Timer();
-        m.Save(name);
-        times[T_IO] += Timer() - t;
+        T += dt;
+        nsteps++;
+        double dtDone = dt;
+        dt = nextTimeStep(T, nit, stepLinIt);
+        acceptStep(dtDone);
+
+        out.stepDone(nsteps, T);
+        if(chkEvery > 0 && nsteps % chkEvery == 0){
+            RunState st = {0, T, nsteps, nrej, newtit, 0, linit, linitRef, {ew.itsSaved, 0.}};
+            saveCheckpoint(st, out);
+        }
+        if(useAMR && nsteps % amrEvery == 0)
+            remesh();
     }
+    out.finish();
+    times[T_IO] += out.tIO;
+    if(outAsync && !outLegacy)
+        printf("Output written in background: %lf s\n", out.tWriter);
     //cout << "Total Newton iterations: " << newtit << endl;
     //cout << "Total linear iterations: " << linit << endl;
-    printf("Total Newton    iterations: %d (av. %d per t.st.)\n", newtit, newtit/nt);
-    printf("Total linear    iterations: %d (av. %d per Newt.it.)\n", linit, linit/newtit);
+    printf("Time steps: %d accepted, %d rejected\n", nsteps, nrej);
+    printf("Total Newton    iterations: %d (av. %d per t.st.)\n", newtit, newtit/max(nsteps,1));
+    printf("Total linear    iterations: %d (av. %d per Newt.it.)\n", linit, linit/max(newtit,1));
+    if(ewChoice != 0)
+        printf("Linear iterations saved by inexact Newton (estimate): %.0f\n", ew.itsSaved);
+    if(useCPR){
+        printf("CPR head stage  iterations: %d (%s), failed head solves: %d\n", cpr.itsHead, cprPressure.c_str(), cpr.headFails);
+        if(linCompare)
+            printf("inner_ilu2 on same systems: %d linear iterations (CPR: %d)\n", linitRef, linit);
+    }
 }
 
 void Problem::runSimulationSIM()
@@ -694,25 +2804,28 @@ void Problem::runSimulationSIM()
 
     double t = Timer();
 
-    Automatizator::MakeCurrent(&aut);
-    auto indH = aut.RegisterTag(tagHead, CELL);
-    auto indC = aut.RegisterTag(tagConc, CELL);
-    dynamic_variable varH(aut, indH);
-    dynamic_variable varC(aut, indC);
-    aut.DeactivateEntry(indC);
-    aut.EnumerateEntries();
-    printf("Indices: %d %d\n", aut.GetFirstIndex(), aut.GetLastIndex());
-    Residual RFlow("RFlow", aut.GetFirstIndex(), aut.GetLastIndex());
-
-    aut.ActivateEntry(indC);
-    aut.DeactivateEntry(indH);
-    aut.EnumerateEntries();
-    Residual RTran("RTran", aut.GetFirstIndex(), aut.GetLastIndex());
+    // Flow and transport unknowns are enumerated once by separate
+    // automatizators, switching stages only changes the current one.
+    // Concentration is registered for flow but inactive there
+    Automatizator autFlow("flow"), autTran("tran");
+    auto indHF = autFlow.RegisterTag(tagHead, CELL);
+    auto indCF = autFlow.RegisterTag(tagConc, CELL);
+    dynamic_variable varH(autFlow, indHF);
+    dynamic_variable varCF(autFlow, indCF);
+    autFlow.DeactivateEntry(indCF);
+    autFlow.EnumerateEntries();
+    printf("Indices: %d %d\n", autFlow.GetFirstIndex(), autFlow.GetLastIndex());
+    Residual RFlow("RFlow", autFlow.GetFirstIndex(), autFlow.GetLastIndex());
+
+    auto indC = autTran.RegisterTag(tagConc, CELL);
+    dynamic_variable varC(autTran, indC);
+    autTran.EnumerateEntries();
+    Residual RTran("RTran", autTran.GetFirstIndex(), autTran.GetLastIndex());
 
 
     vector<dynamic_variable> varsFlow, varsTran;
     varsFlow.push_back(varH);
-    varsFlow.push_back(varC);
+    varsFlow.push_back(varCF);
     varsTran.push_back(varC);
     Process_ConfinedFlow pFlow(&m, varsFlow);
     Process_Diffusion    pDiff(&m, varsTran);
@@ -722,64 +2835,95 @@ void Problem::runSimulationSIM()
     pAdv.setSteady(false);
     pAdv.setFlow(&pFlow);
 
-    Solver S("inner_ilu2");
-    S.SetParameter("relative_tolerance", "1e-12");
-    S.SetParameter("absolute_tolerance", "1e-15");
-    Sparse::Vector sol("sol", aut.GetFirstIndex(), aut.GetLastIndex());
-
-    Tag tagDens = m.CreateTag("Density", DATA_REAL, CELL, NONE, 1);
-
-    for(auto icell = m.BeginCell(); icell != m.EndCell(); icell++){
-        Cell c = icell->getAsCell();
-        double x[2];
-        c.Barycenter(x);
-        double r2 = (x[0]-0.5)*(x[0]-0.5) + (x[1]-0.5)*(x[1]-0.5);
-        if(r2 < 0.01){
-            c.Real(tagHead) = 0.;
-            c.Real(tagConc) = 1.;
-        }
-        else{
-            c.Real(tagHead) = 0.;
-            c.Real(tagConc) = 0.;
-        }
-        c.Real(tagHeadPrev) = c.Real(tagHead);
-        c.Real(tagConcPrev) = c.Real(tagConc);
-        c.Real(tagDens)     = density(c.Real(tagConc)).GetValue();
-    }
+    // Separate solvers keep separate preconditioners for flow and transport
+    Solver SFlow("inner_ilu2"), STran("inner_ilu2");
+    SFlow.SetParameter("relative_tolerance", "1e-12");
+    SFlow.SetParameter("absolute_tolerance", "1e-15");
+    STran.SetParameter("relative_tolerance", "1e-12");
+    STran.SetParameter("absolute_tolerance", "1e-15");
+    Sparse::Vector sol("sol", autFlow.GetFirstIndex(), autFlow.GetLastIndex());
+    PreconditionerReuse pcFlow, pcTran;
+    ForcingTerm ewFlow, ewTran;
+    SplittingAcceleration accel;
+    vector<double> xSpl, gSpl;
+
+    setInitialState();
     times[T_INIT] += Timer() - t;
 
-    t = Timer();
-    m.Save("sol0.vtk");
-    times[T_IO] += Timer() - t;
-
-    int newtit = 0, nspl = 0;
-    const double tol_split = 1e-4;
-    for(int it = 0; it < nt; it++){
-        cout << endl << "===== TIME STEP " << it << ", T = " << it*dt << " =====" << endl;
-        // Save old values
-        for(auto icell = m.BeginCell(); icell != m.EndCell(); icell++){
-            Cell c = icell->getAsCell();
-            c.Real(tagHeadPrev) = c.Real(tagHead);
-            c.Real(tagConcPrev) = c.Real(tagConc);
+    OutputWriter out(&m);
+
+    auto remesh = [&]() -> bool {
+        MarkerType changed = m.CreateMarker();
+        bool done = adaptMesh(changed);
+        if(done){
+            double ta = Timer();
+            autFlow.EnumerateEntries();
+            autTran.EnumerateEntries();
+            RFlow.SetInterval(autFlow.GetFirstIndex(), autFlow.GetLastIndex());
+            RFlow.Clear();
+            RTran.SetInterval(autTran.GetFirstIndex(), autTran.GetLastIndex());
+            RTran.Clear();
+            sol.SetInterval(autFlow.GetFirstIndex(), autFlow.GetLastIndex());
+            pFlow.meshChanged(changed);
+            pDiff.meshChanged(changed);
+            pAdv.meshChanged(changed);
+            pcFlow.invalidate();
+            pcTran.invalidate();
+            out.meshChanged();
+            times[T_ADAPT] += Timer() - ta;
         }
-
-        bool converged_outer = false;
+        m.ReleaseMarker(changed, CELL);
+        return done;
+    };
+    if(useAMR && restartFile.empty())
+        for(int lev = 0; lev < amrMaxLevel && remesh(); lev++)
+            setInitialState();
+
+    int newtit = 0, nspl = 0, nsteps = 0, nrej = 0;
+    const double tol_split = 1e-4;
+    double T = 0.;
+    RunState rs = {1, 0., 0, 0, 0, 0, 0, 0, {0., 0.}};
+    if(restartFile.empty())
+        out.write(0, 0.);
+    else{
+        loadCheckpoint(rs, out);
+        T = rs.T;
+        nsteps = rs.nsteps;
+        nrej = rs.nrej;
+        newtit = rs.newtit;
+        nspl = rs.nspl;
+        linit = rs.linit;
+        ewFlow.itsSaved = rs.itsSaved[0];
+        ewTran.itsSaved = rs.itsSaved[1];
+    }
+    while(Tfinal - T > 1e-10*Tfinal){
+        cout << endl << "===== TIME STEP " << nsteps << ", T = " << T << ", dt = " << dt << " =====" << endl;
+        // Old values are kept in Prev tags, shifted on acceptance
+        setTimeCoefficients();
+        pcFlow.newTimeStep();
+        pcTran.newTimeStep();
+        accel.reset();
+
+        bool converged_outer = false, failed = false;
         bool smallNormF, smallNormT;
-        smallNormF = smallNormT = false;
-        for(int ispl = 0; ispl < 200; ispl++){
+        int stepNwtIt = 0, stepLinIt = 0;
+        for(int ispl = 0; ispl < 200 && !failed; ispl++){
             nspl++;
             cout << endl << "*** splitting step " << ispl << " ***" << endl;
+            // Both residuals have to be small at the same splitting step
+            smallNormF = smallNormT = false;
+            if(splitAccel != ACCEL_NONE)
+                getState(xSpl);
             // Newton loop for flow
             cout << "flow:" << endl;
-            aut.ActivateEntry(indH);
-            aut.DeactivateEntry(indC);
-            aut.EnumerateEntries();
+            Automatizator::MakeCurrent(&autFlow);
             bool converged = false;
-            double norm2, norm2_0 = 0.0;
-            for(int nit = 0; nit < 100; nit++){
+            double norm2, norm2_0 = 0.0, w = 1., normLS = 0.;
+            ewFlow.reset();
+            for(int nit = 0; nit < nwtMaxIt; nit++){
                 // Assemble residual
                 t = Timer();
-                RFlow.Clear();
+                clearValues(RFlow);
                 pFlow.fillResidual(RFlow);
                 times[T_ASSEMBLE] += Timer() - t;
 
@@ -791,36 +2935,55 @@ void Problem::runSimulationSIM()
                 }
                 cout << " it " << nit << ": |r|_2 = " << norm2 << endl;
 
+                // Backtrack if the update did not decrease the residual enough
+                if(lineSearch && nit > 0 && !(norm2 <= (1. - 1e-4*w)*normLS) && w > lsMinW){
+                    w *= 0.5;
+                    cout << "  line search: w = " << w << endl;
+                    applyNewtonUpdate(sol, varH, varC, w, true, false);
+                    continue;
+                }
+                if(norm2 != norm2)
+                    break;
                 if(norm2 < 1e-6 || norm2 < 1e-4*norm2_0){
                     converged = true;
+                    stepNwtIt = max(stepNwtIt, nit);
                     break;
                 }
 
+                ewFlow.setTolerance(SFlow, norm2, max(1e-6, 1e-4*norm2_0));
+                ewFlow.initialGuess(sol);
                 t = Timer();
-                S.SetMatrix(RFlow.GetJacobian());
+                pcFlow.setMatrix(SFlow, RFlow.GetJacobian());
                 newtit++;
                 times[T_PRECOND] += Timer() - t;
                 //R.GetJacobian().Save("J" + to_string(it+1) + ".mtx");
                 t = Timer();
-                bool solved = S.Solve(RFlow.GetResidual(), sol);
+                bool solved = SFlow.Solve(RFlow.GetResidual(), sol);
+                if(!solved && pcFlow.isStale()){
+                    cout << " retry with new preconditioner" << endl;
+                    pcFlow.setMatrix(SFlow, RFlow.GetJacobian(), true);
+                    solved = SFlow.Solve(RFlow.GetResidual(), sol);
+                }
                 times[T_SOLVE] += Timer() - t;
+                pcFlow.update(SFlow.Iterations());
+                ewFlow.update(SFlow.Residual(), SFlow.Iterations());
+                linit += SFlow.Iterations();
+                stepLinIt = max(stepLinIt, SFlow.Iterations());
                 if(!solved){
-                    cout << "Linear solver failed: " << S.GetReason() << endl;
-                    cout << "Residual: " << S.Residual() << endl;
-                    exit(1);
+                    cout << "Linear solver failed: " << SFlow.GetReason() << endl;
+                    cout << "Residual: " << SFlow.Residual() << endl;
+                    break;
                 }
-                //cout << "Linear solver iterations: " << S.Iterations() << endl;
-                linit += S.Iterations();
 
-                double w = 1;//0.125;
-                for(auto icell = m.BeginCell(); icell != m.EndCell(); icell++){
-                    Cell c = icell->getAsCell();
-                    c.Real(tagHead) -= w*sol[varH.Index(c)];
-                }
+                w = 1.;
+                normLS = norm2;
+                saveIterate();
+                applyNewtonUpdate(sol, varH, varC, w, true, false);
             }
             if(!converged){
                 cout << "Newton for flow failed" << endl;
-                exit(1);
+                failed = true;
+                break;
             }
 
 
@@ -828,13 +2991,16 @@ void Problem::runSimulationSIM()
             cout << "transport:" << endl;
             converged = false;
             norm2 = norm2_0 = 0.0;
-            aut.DeactivateEntry(indH);
-            aut.ActivateEntry(indC);
-            aut.EnumerateEntries();
-            for(int nit = 0; nit < 100; nit++){
+            w = 1.;
+            normLS = 0.;
+            Automatizator::MakeCurrent(&autTran);
+            // Head is frozen during transport, fluxes are computed once
+            pFlow.computeFluxes(true);
+            ewTran.reset();
+            for(int nit = 0; nit < nwtMaxIt; nit++){
                 // Assemble residual
                 t = Timer();
-                RTran.Clear();
+                clearValues(RTran);
                 pDiff.fillResidual(RTran);
                 pAdv.fillResidual(RTran);
                 times[T_ASSEMBLE] += Timer() - t;
@@ -847,37 +3013,55 @@ void Problem::runSimulationSIM()
                 }
                 cout << " it " << nit << ": |r|_2 = " << norm2 << endl;
 
+                // Backtrack if the update did not decrease the residual enough
+                if(lineSearch && nit > 0 && !(norm2 <= (1. - 1e-4*w)*normLS) && w > lsMinW){
+                    w *= 0.5;
+                    cout << "  line search: w = " << w << endl;
+                    applyNewtonUpdate(sol, varH, varC, w, false, true);
+                    continue;
+                }
+                if(norm2 != norm2)
+                    break;
                 if(norm2 < 1e-6 || norm2 < 1e-4*norm2_0){
                     converged = true;
+                    stepNwtIt = max(stepNwtIt, nit);
                     break;
                 }
 
+                ewTran.setTolerance(STran, norm2, max(1e-6, 1e-4*norm2_0));
+                ewTran.initialGuess(sol);
                 t = Timer();
-                S.SetMatrix(RTran.GetJacobian());
+                pcTran.setMatrix(STran, RTran.GetJacobian());
                 newtit++;
                 times[T_PRECOND] += Timer() - t;
                 //R.GetJacobian().Save("J" + to_string(it+1) + ".mtx");
                 t = Timer();
-                bool solved = S.Solve(RTran.GetResidual(), sol);
+                bool solved = STran.Solve(RTran.GetResidual(), sol);
+                if(!solved && pcTran.isStale()){
+                    cout << " retry with new preconditioner" << endl;
+                    pcTran.setMatrix(STran, RTran.GetJacobian(), true);
+                    solved = STran.Solve(RTran.GetResidual(), sol);
+                }
                 times[T_SOLVE] += Timer() - t;
+                pcTran.update(STran.Iterations());
+                ewTran.update(STran.Residual(), STran.Iterations());
+                linit += STran.Iterations();
+                stepLinIt = max(stepLinIt, STran.Iterations());
                 if(!solved){
-                    cout << "Linear solver failed: " << S.GetReason() << endl;
-                    cout << "Residual: " << S.Residual() << endl;
-                    exit(1);
-                }
-                //cout << "Linear solver iterations: " << S.Iterations() << endl;
-                linit += S.Iterations();
-
-                double w = 1;//0.125;
-                for(auto icell = m.BeginCell(); icell != m.EndCell(); icell++){
-                    Cell c = icell->getAsCell();
-                    c.Real(tagConc) -= w*sol[varC.Index(c)];
-                    c.Real(tagDens)  = density(c.Real(tagConc)).GetValue();
+                    cout << "Linear solver failed: " << STran.GetReason() << endl;
+                    cout << "Residual: " << STran.Residual() << endl;
+                    break;
                 }
+
+                w = 1.;
+                normLS = norm2;
+                saveIterate();
+                applyNewtonUpdate(sol, varH, varC, w, false, true);
             }
             if(!converged){
                 cout << "Newton for transport failed" << endl;
-                exit(1);
+                failed = true;
+                break;
             }
 
 
@@ -885,22 +3069,271 @@ void Problem::runSimulationSIM()
                 converged_outer = true;
                 break;
             }
+
+            if(splitAccel != ACCEL_NONE){
+                getState(gSpl);
+                accel.update(xSpl, gSpl);
+                setState(gSpl);
+            }
         }
         if(!converged_outer){
             cout << "splitting failed!" << endl;
-            exit(1);
+            nrej++;
+            rejectStep();
+            continue;
         }
 
-        string name = "sol" + to_string(it+1) + ".vtk";
-        t = Timer();
-        m.Save(name);
-        times[T_IO] += Timer() - t;
+        T += dt;
+        nsteps++;
+        double dtDone = dt;
+        dt = nextTimeStep(T, stepNwtIt, stepLinIt);
+        acceptStep(dtDone);
+
+        out.stepDone(nsteps, T);
+        if(chkEvery > 0 && nsteps % chkEvery == 0){
+            RunState st = {1, T, nsteps, nrej, newtit, nspl, linit, 0, {ewFlow.itsSaved, ewTran.itsSaved}};
+            saveCheckpoint(st, out);
+        }
+        if(useAMR && nsteps % amrEvery == 0)
+            remesh();
     }
+    out.finish();
+    times[T_IO] += out.tIO;
+    if(outAsync && !outLegacy)
+        printf("Output written in background: %lf s\n", out.tWriter);
 //    cout << "Total Newton iterations: " << newtit << endl;
 //    cout << "Total linear iterations: " << linit << endl;
-    printf("Total splitting iterations: %d (av. %d per t.st.)\n", nspl, nspl/nt);
-    printf("Total Newton    iterations: %d (av. %d per t.st., %d per spl.it.)\n", newtit, newtit/nt, newtit/nspl);
-    printf("Total linear    iterations: %d (av. %d per Newt.it.)\n", linit, linit/newtit);
+    printf("Time steps: %d accepted, %d rejected\n", nsteps, nrej);
+    printf("Total splitting iterations: %d (av. %d per t.st.)\n", nspl, nspl/max(nsteps,1));
+    printf("Total Newton    iterations: %d (av. %d per t.st., %d per spl.it.)\n", newtit, newtit/max(nsteps,1), newtit/max(nspl,1));
+    printf("Total linear    iterations: %d (av. %d per Newt.it.)\n", linit, linit/max(newtit,1));
+    if(ewChoice != 0)
+        printf("Linear iterations saved by inexact Newton (estimate): %.0f\n", ewFlow.itsSaved + ewTran.itsSaved);
+}
+
+
+// Implicit flow, then explicit transport: concentration is advanced by
+// forward Euler substeps with fluxes from the new head. Substep is limited
+// by cflImpes * V / a, where a is the diagonal of the transport operator
+// (outflow fluxes plus TPFA diffusion coefficients), V the cell volume
+// as in the storage term of transport. The diagonal is that of first
+// order upwind; with MUSCL cflImpes is capped by cflMUSCL in main
+void Problem::runSimulationIMPES()
+{
+    int linit = 0;
+
+    double t = Timer();
+
+    if(useBDF2){
+        cout << "IMPES uses backward Euler, -time bdf2 ignored" << endl;
+        useBDF2 = false;
+    }
+
+    // Only flow has unknowns, concentration is registered but inactive
+    Automatizator autFlow("flow");
+    auto indHF = autFlow.RegisterTag(tagHead, CELL);
+    auto indCF = autFlow.RegisterTag(tagConc, CELL);
+    dynamic_variable varH(autFlow, indHF);
+    dynamic_variable varCF(autFlow, indCF);
+    autFlow.DeactivateEntry(indCF);
+    autFlow.EnumerateEntries();
+    Residual RFlow("RFlow", autFlow.GetFirstIndex(), autFlow.GetLastIndex());
+    Automatizator::MakeCurrent(&autFlow);
+
+    vector<dynamic_variable> varsFlow, varsTran;
+    varsFlow.push_back(varH);
+    varsFlow.push_back(varCF);
+    varsTran.push_back(varCF);
+    Process_ConfinedFlow pFlow(&m, varsFlow);
+    Process_Diffusion    pDiff(&m, varsTran);
+    Process_Advection    pAdv (&m, varsTran);
+    pFlow.setSteady(false);
+    pAdv.setFlow(&pFlow);
+
+    Solver SFlow("inner_ilu2");
+    SFlow.SetParameter("relative_tolerance", "1e-12");
+    SFlow.SetParameter("absolute_tolerance", "1e-15");
+    Sparse::Vector sol("sol", autFlow.GetFirstIndex(), autFlow.GetLastIndex());
+    PreconditionerReuse pcFlow;
+    ForcingTerm ewFlow;
+
+    setInitialState();
+    times[T_INIT] += Timer() - t;
+
+    // Kernel arrays by cell local ID
+    vector<double> C, rate, diag, vol;
+    auto resizeKernel = [&](){
+        int nc = m.CellLastLocalID();
+        C.assign(nc, 0.);
+        rate.assign(nc, 0.);
+        diag.assign(nc, 0.);
+        vol.assign(nc, 0.);
+        for(auto icell = m.BeginCell(); icell != m.EndCell(); icell++)
+            vol[icell->LocalID()] = icell->Volume();
+    };
+    resizeKernel();
+
+    OutputWriter out(&m);
+
+    auto remesh = [&]() -> bool {
+        MarkerType changed = m.CreateMarker();
+        bool done = adaptMesh(changed);
+        if(done){
+            double ta = Timer();
+            autFlow.EnumerateEntries();
+            RFlow.SetInterval(autFlow.GetFirstIndex(), autFlow.GetLastIndex());
+            RFlow.Clear();
+            sol.SetInterval(autFlow.GetFirstIndex(), autFlow.GetLastIndex());
+            pFlow.meshChanged(changed);
+            pDiff.meshChanged(changed);
+            pAdv.meshChanged(changed);
+            pcFlow.invalidate();
+            resizeKernel();
+            out.meshChanged();
+            times[T_ADAPT] += Timer() - ta;
+        }
+        m.ReleaseMarker(changed, CELL);
+        return done;
+    };
+    if(useAMR && restartFile.empty())
+        for(int lev = 0; lev < amrMaxLevel && remesh(); lev++)
+            setInitialState();
+    int newtit = 0, nsub = 0, nsteps = 0, nrej = 0;
+    double T = 0.;
+    RunState rs = {2, 0., 0, 0, 0, 0, 0, 0, {0., 0.}};
+    if(restartFile.empty())
+        out.write(0, 0.);
+    else{
+        loadCheckpoint(rs, out);
+        T = rs.T;
+        nsteps = rs.nsteps;
+        nrej = rs.nrej;
+        newtit = rs.newtit;
+        nsub = rs.nspl;
+        linit = rs.linit;
+        ewFlow.itsSaved = rs.itsSaved[0];
+    }
+    while(Tfinal - T > 1e-10*Tfinal){
+        cout << endl << "===== TIME STEP " << nsteps << ", T = " << T << ", dt = " << dt << " =====" << endl;
+        setTimeCoefficients();
+        pcFlow.newTimeStep();
+
+        // Newton loop for flow with concentration from the previous step
+        bool converged = false;
+        int nit = 0, stepLinIt = 0;
+        double norm2, norm2_0 = 0.0, w = 1., normLS = 0.;
+        ewFlow.reset();
+        for(nit = 0; nit < nwtMaxIt; nit++){
+            t = Timer();
+            clearValues(RFlow);
+            pFlow.fillResidual(RFlow);
+            times[T_ASSEMBLE] += Timer() - t;
+
+            norm2 = RFlow.Norm();
+            if(nit == 0)
+                norm2_0 = norm2;
+            cout << "it " << nit << ": |r|_2 = " << norm2 << endl;
+
+            // Backtrack if the update did not decrease the residual enough
+            if(lineSearch && nit > 0 && !(norm2 <= (1. - 1e-4*w)*normLS) && w > lsMinW){
+                w *= 0.5;
+                cout << "  line search: w = " << w << endl;
+                applyNewtonUpdate(sol, varH, varCF, w, true, false);
+                continue;
+            }
+            if(norm2 != norm2)
+                break;
+            if(norm2 < 1e-6 || norm2 < 1e-5*norm2_0){
+                converged = true;
+                break;
+            }
+
+            ewFlow.setTolerance(SFlow, norm2, max(1e-6, 1e-5*norm2_0));
+            ewFlow.initialGuess(sol);
+            newtit++;
+            bool solved = solveLinear(SFlow, pcFlow, RFlow, sol);
+            ewFlow.update(SFlow.Residual(), SFlow.Iterations());
+            linit += SFlow.Iterations();
+            stepLinIt = max(stepLinIt, SFlow.Iterations());
+            if(!solved){
+                cout << "Linear solver failed: " << SFlow.GetReason() << endl;
+                cout << "Residual: " << SFlow.Residual() << endl;
+                break;
+            }
+
+            w = 1.;
+            normLS = norm2;
+            saveIterate();
+            applyNewtonUpdate(sol, varH, varCF, w, true, false);
+        }
+        if(!converged){
+            cout << "Newton failed" << endl;
+            nrej++;
+            rejectStep();
+            continue;
+        }
+
+        // Explicit transport with frozen fluxes
+        t = Timer();
+        pFlow.computeFluxes(true);
+        for(auto icell = m.BeginCell(); icell != m.EndCell(); icell++)
+            C[icell->LocalID()] = icell->Real(tagConc);
+        fill(rate.begin(), rate.end(), 0.);
+        fill(diag.begin(), diag.end(), 0.);
+        pAdv.addRate(C, rate, &diag);
+        pDiff.addRate(C, rate, &diag);
+        double dtau = dt;
+        for(auto icell = m.BeginCell(); icell != m.EndCell(); icell++){
+            int k = icell->LocalID();
+            if(diag[k] > 0.)
+                dtau = min(dtau, cflImpes * vol[k] / diag[k]);
+        }
+        int nSubStep = static_cast<int>(ceil(dt / dtau - 1e-10));
+        dtau = dt / nSubStep;
+        for(int isub = 0; isub < nSubStep; isub++){
+            if(isub > 0){
+                fill(rate.begin(), rate.end(), 0.);
+                pAdv.addRate(C, rate);
+                pDiff.addRate(C, rate);
+            }
+            for(auto icell = m.BeginCell(); icell != m.EndCell(); icell++){
+                int k = icell->LocalID();
+                C[k] += dtau * rate[k] / vol[k];
+            }
+        }
+        nsub += nSubStep;
+        for(auto icell = m.BeginCell(); icell != m.EndCell(); icell++){
+            Cell c = icell->getAsCell();
+            c.Real(tagConc) = C[c.LocalID()];
+            c.Real(tagDens) = density(c.Real(tagConc)).GetValue();
+        }
+        times[T_UPDATE] += Timer() - t;
+        cout << "transport: " << nSubStep << " substeps of " << dtau << endl;
+
+        T += dt;
+        nsteps++;
+        double dtDone = dt;
+        dt = nextTimeStep(T, nit, stepLinIt);
+        acceptStep(dtDone);
+
+        out.stepDone(nsteps, T);
+        if(chkEvery > 0 && nsteps % chkEvery == 0){
+            RunState st = {2, T, nsteps, nrej, newtit, nsub, linit, 0, {ewFlow.itsSaved, 0.}};
+            saveCheckpoint(st, out);
+        }
+        if(useAMR && nsteps % amrEvery == 0)
+            remesh();
+    }
+    out.finish();
+    times[T_IO] += out.tIO;
+    if(outAsync && !outLegacy)
+        printf("Output written in background: %lf s\n", out.tWriter);
+    printf("Time steps: %d accepted, %d rejected\n", nsteps, nrej);
+    printf("Total transport substeps:   %d (av. %d per t.st.)\n", nsub, nsub/max(nsteps,1));
+    printf("Total Newton    iterations: %d (av. %d per t.st.)\n", newtit, newtit/max(nsteps,1));
+    printf("Total linear    iterations: %d (av. %d per Newt.it.)\n", linit, linit/max(newtit,1));
+    if(ewChoice != 0)
+        printf("Linear iterations saved by inexact Newton (estimate): %.0f\n", ewFlow.itsSaved);
 }
 
 
@@ -969,25 +3402,229 @@ void Problem::testDiffusion()
     m.Save("res.vtk");
 }
 
+void printUsage()
+{
+    cout << "Usage: 2d_dens_driven_flow <mesh_file> <method (fim, sim or impes)> [options]" << endl;
+    cout << "Options:" << endl;
+    cout << "  -T     <final time>        (default " << Tfinal << ")" << endl;
+    cout << "  -dt    <initial time step> (default " << dt << ")" << endl;
+    cout << "  -dtmin <min time step>     (default " << dtMin << ")" << endl;
+    cout << "  -dtmax <max time step>     (default " << dtMax << ")" << endl;
+    cout << "  -time  <be or bdf2>        (default be)" << endl;
+    cout << "  -pc_age    <N>   rebuild preconditioner after N Newton iterations (default 1, no reuse)" << endl;
+    cout << "  -pc_growth <f>   rebuild if linear iterations grow f times (default 2)" << endl;
+    cout << "  -pc_step   <0/1> rebuild at every time step (default 1)" << endl;
+    cout << "  -ew    <0, 1 or 2>         inexact Newton with Eisenstat-Walker forcing (default 0, off)" << endl;
+    cout << "  -ls    <0/1>               backtracking line search (default 0)" << endl;
+    cout << "  -out   <pvd or vtk>        output format (default pvd)" << endl;
+    cout << "  -out_prefix <name>         output file prefix (default " << outPrefix << ")" << endl;
+    cout << "  -out_every  <k>            write every k-th time step, 0 - off (default " << outEvery << ")" << endl;
+    cout << "  -out_dt     <t>            write every t of model time, 0 - off (default " << outDt << ")" << endl;
+    cout << "  -out_fields <tag,tag,...>  cell tags written to pvd (default " << outFields << ")" << endl;
+    cout << "  -out_async  <0/1>          write pvd output in background thread (default 1)" << endl;
+    cout << "  -adv   <upwind or muscl>   advection scheme (default upwind)" << endl;
+    cout << "  -limiter <bj or venkat>    MUSCL slope limiter (default bj)" << endl;
+    cout << "  -cfl   <Courant number>    explicit transport substeps in impes (default " << cflImpes << ", at most " << cflMUSCL << " with muscl)" << endl;
+    cout << "  -chk_every  <k>            write checkpoint every k-th time step, 0 - off (default 0)" << endl;
+    cout << "  -chk_prefix <name>         checkpoint file is <name>.chk (default " << chkPrefix << ")" << endl;
+    cout << "  -restart    <file.chk>     continue run from checkpoint (same mesh and method)" << endl;
+    cout << "  -gravity <gx,gy>           upward direction, elevation is its dot product with x (default 0,1)" << endl;
+    cout << "  -amr   <0/1>               adaptive refinement of the concentration front (default 0)" << endl;
+    cout << "  -amr_every   <k>           adapt every k-th time step (default " << amrEvery << ")" << endl;
+    cout << "  -amr_level   <n>           max refinement level (default " << amrMaxLevel << ")" << endl;
+    cout << "  -amr_refine  <jump>        refine where conc. jumps to a neighbour more (default " << amrRefine << ")" << endl;
+    cout << "  -amr_coarsen <jump>        coarsen where jumps are below (default " << amrCoarsen << ")" << endl;
+    cout << "  -accel <none, aitken or anderson> acceleration of sim splitting (default none)" << endl;
+    cout << "  -aa_m  <depth>             Anderson depth (default " << andersonDepth << ")" << endl;
+    cout << "  -lin   <ilu or cpr>        linear solver for fim (default ilu)" << endl;
+    cout << "  -cpr_p <solver type>       INMOST solver for the CPR head stage (default " << cprPressure << ")" << endl;
+    cout << "  -lin_cmp <0/1>             also solve fim systems with inner_ilu2 and report its iterations" << endl;
+    cout << "  -chop  <0/1>               chopping of Newton updates (default 0)" << endl;
+    cout << "  -dhmax <max head change>   (default " << dHMax << ")" << endl;
+    cout << "  -dcmax <max conc. change>  (default " << dCMax << ")" << endl;
+}
+
 int main(int argc, char *argv[])
 {
-    if(argc != 3){
-        cout << "Usage: 2d_dens_driven_flow <mesh_file> <method (fim or sim)>" << endl;
+    if(argc < 3 || argc % 2 == 0){
+        printUsage();
         return 1;
     }
     string method(argv[2]);
-    if(method != "fim" && method != "sim"){
-        cout << "Usage: 2d_dens_driven_flow <mesh_file> <method (fim or sim)>" << endl;
+    if(method != "fim" && method != "sim" && method != "impes"){
+        printUsage();
+        return 1;
+    }
+    for(int i = 3; i < argc; i += 2){
+        string key(argv[i]);
+        double val = atof(argv[i+1]);
+        if(key == "-time"){
+            string scheme(argv[i+1]);
+            if(scheme != "be" && scheme != "bdf2"){
+                printUsage();
+                return 1;
+            }
+            useBDF2 = (scheme == "bdf2");
+        }
+        else if(key == "-T")
+            Tfinal = val;
+        else if(key == "-dt")
+            dt = val;
+        else if(key == "-dtmin")
+            dtMin = val;
+        else if(key == "-dtmax")
+            dtMax = val;
+        else if(key == "-pc_age")
+            pcMaxAge = max(1, atoi(argv[i+1]));
+        else if(key == "-pc_growth")
+            pcGrowth = val;
+        else if(key == "-pc_step")
+            pcStepRebuild = (atoi(argv[i+1]) != 0);
+        else if(key == "-lin"){
+            string lin(argv[i+1]);
+            if(lin != "ilu" && lin != "cpr"){
+                printUsage();
+                return 1;
+            }
+            useCPR = (lin == "cpr");
+        }
+        else if(key == "-out"){
+            string fmt(argv[i+1]);
+            if(fmt != "pvd" && fmt != "vtk"){
+                printUsage();
+                return 1;
+            }
+            outLegacy = (fmt == "vtk");
+        }
+        else if(key == "-out_prefix")
+            outPrefix = argv[i+1];
+        else if(key == "-out_every")
+            outEvery = max(0, atoi(argv[i+1]));
+        else if(key == "-out_dt")
+            outDt = max(0., val);
+        else if(key == "-out_fields")
+            outFields = argv[i+1];
+        else if(key == "-out_async")
+            outAsync = (atoi(argv[i+1]) != 0);
+        else if(key == "-adv"){
+            string adv(argv[i+1]);
+            if(adv != "upwind" && adv != "muscl"){
+                printUsage();
+                return 1;
+            }
+            advMUSCL = (adv == "muscl");
+        }
+        else if(key == "-limiter"){
+            string lim(argv[i+1]);
+            if(lim != "bj" && lim != "venkat"){
+                printUsage();
+                return 1;
+            }
+            limiterType = (lim == "bj") ? LIM_BJ : LIM_VENKAT;
+        }
+        else if(key == "-cfl")
+            cflImpes = val;
+        else if(key == "-chk_every")
+            chkEvery = max(0, atoi(argv[i+1]));
+        else if(key == "-chk_prefix")
+            chkPrefix = argv[i+1];
+        else if(key == "-restart")
+            restartFile = argv[i+1];
+        else if(key == "-gravity"){
+            if(sscanf(argv[i+1], "%lf,%lf", &gravityDir[0], &gravityDir[1]) != 2){
+                printUsage();
+                return 1;
+            }
+        }
+        else if(key == "-amr")
+            useAMR = (atoi(argv[i+1]) != 0);
+        else if(key == "-amr_every")
+            amrEvery = max(1, atoi(argv[i+1]));
+        else if(key == "-amr_level")
+            amrMaxLevel = max(0, atoi(argv[i+1]));
+        else if(key == "-amr_refine")
+            amrRefine = val;
+        else if(key == "-amr_coarsen")
+            amrCoarsen = val;
+        else if(key == "-accel"){
+            string acc(argv[i+1]);
+            if(acc == "none")
+                splitAccel = ACCEL_NONE;
+            else if(acc == "aitken")
+                splitAccel = ACCEL_AITKEN;
+            else if(acc == "anderson")
+                splitAccel = ACCEL_ANDERSON;
+            else{
+                printUsage();
+                return 1;
+            }
+        }
+        else if(key == "-aa_m")
+            andersonDepth = max(1, atoi(argv[i+1]));
+        else if(key == "-cpr_p")
+            cprPressure = argv[i+1];
+        else if(key == "-lin_cmp")
+            linCompare = (atoi(argv[i+1]) != 0);
+        else if(key == "-ls")
+            lineSearch = (atoi(argv[i+1]) != 0);
+        else if(key == "-chop")
+            chopping = (atoi(argv[i+1]) != 0);
+        else if(key == "-dhmax")
+            dHMax = val;
+        else if(key == "-dcmax")
+            dCMax = val;
+        else if(key == "-ew"){
+            ewChoice = atoi(argv[i+1]);
+            if(ewChoice < 0 || ewChoice > 2){
+                printUsage();
+                return 1;
+            }
+        }
+        else{
+            cout << "Unknown option " << key << endl;
+            printUsage();
+            return 1;
+        }
+    }
+    if(!(dtMin > 0. && dtMin <= dt && dt <= dtMax && Tfinal > 0.)){
+        cout << "Need 0 < dtmin <= dt <= dtmax and T > 0" << endl;
+        return 1;
+    }
+    double gNorm = sqrt(gravityDir[0]*gravityDir[0] + gravityDir[1]*gravityDir[1]);
+    if(!(gNorm > 0.)){
+        cout << "Gravity direction must be nonzero" << endl;
+        return 1;
+    }
+    gravityDir[0] /= gNorm;
+    gravityDir[1] /= gNorm;
+    if(advMUSCL && cflImpes > cflMUSCL){
+        cout << "MUSCL advection needs -cfl <= " << cflMUSCL << ", using " << cflMUSCL << endl;
+        cflImpes = cflMUSCL;
+    }
+    // Checkpoints store cell values of the original mesh only
+    if(useAMR && (chkEvery > 0 || !restartFile.empty())){
+        cout << "Checkpoints and restart are not supported with -amr" << endl;
+        return 1;
+    }
+    if(useAMR && !(amrCoarsen < amrRefine)){
+        cout << "Need amr_coarsen < amr_refine" << endl;
         return 1;
     }
 
-    Problem P(argv[1]);
-    P.initProblem();
-    //P.testDiffusion();
-    if(method == "fim")
-        P.runSimulationFIM();
-    else if(method == "sim")
-        P.runSimulationSIM();
+    // Database allows external solvers (e.g. AMG from PETSc) for the CPR head stage
+    Solver::Initialize(&argc, &argv, "database.xml");
+    {
+        Problem P(argv[1]);
+        P.initProblem();
+        //P.testDiffusion();
+        if(method == "fim")
+            P.runSimulationFIM();
+        else if(method == "sim")
+            P.runSimulationSIM();
+        else if(method == "impes")
+            P.runSimulationIMPES();
+    }
+    Solver::Finalize();
 
     return 0;
 }
@@ -72,6 +72,29 @@ double exactSolutionRHS(double *x)
     return 0.0;//M_PI*M_PI * ((Dxx+Dyy) * exactSolution(x) - 2*Dxy*cos(M_PI*x[0])*cos(M_PI*x[1]));
 }
 
+// Scratch memory for assembleLocalSystem, same scheme as
+// VemWorkspace in vem_local.h, sized by the number of faces
+class LocalWorkspace
+{
+private:
+    vector<double> buf;
+public:
+    unsigned maxnf; // capacity, max number of faces per cell
+    double *NP;     // nf x 2, D-scaled face normals
+    double *RP;     // nf x 2, area-scaled face-to-center vectors
+    double *MF;     // nf x nf, flux inner product matrix
+
+    LocalWorkspace() : maxnf(0), NP(nullptr), RP(nullptr), MF(nullptr) {}
+    void init(unsigned nf)
+    {
+        maxnf = nf;
+        buf.assign(4*nf + nf*nf, 0.0);
+        NP = buf.data();
+        RP = NP + 2*nf;
+        MF = RP + 2*nf;
+    }
+};
+
 class Problem
 {
 private:
@@ -93,6 +116,8 @@ private:
 
     unsigned numDirNodes;
 
+    LocalWorkspace work;   // Storage for local matrices
+
     double times[10];
     double ttt; // global timer
 
@@ -101,7 +126,7 @@ public:
     ~Problem();
     void initProblem(); // create tags and set parameters
     void assembleGlobalSystem(); // assemble global linear system
-    void assembleLocalSystem(Cell &, rMatrix &);
+    void assembleLocalSystem(Cell &, const ElementArray<Face> &); // fills work.MF
     rMatrix integrateRHS(Cell &);
     void solveSystem();
     void saveSolution(string path); // save mesh with solution
@@ -161,11 +186,14 @@ void Problem::initProblem()
     R = Residual("mfd_diffusion", aut.GetFirstIndex(), aut.GetLastIndex());
 
     // Set diffusion tensor,
-    // also check that all cells are triangles
+    // also find the largest number of faces per cell
+    unsigned maxnf = 0;
     for(auto icell = m.BeginCell(); icell != m.EndCell(); icell++){
         if(icell->GetStatus() == Element::Ghost)
             continue;
 
+        maxnf = max(maxnf, icell->nbAdjElements(FACE));
+
         icell->RealArray(tagD)[0] = Dxx; // Dxx
         icell->RealArray(tagD)[1] = Dyy; // Dyy
         icell->RealArray(tagD)[2] = Dxy; // Dxy
@@ -175,6 +203,7 @@ void Problem::initProblem()
         icell->Real(tagSolEx) = exactSolution(x);
     }
     m.ExchangeData(tagD, CELL);
+    work.init(maxnf);
 
     // Set boundary conditions
     // Compute RHS and exact solution
@@ -189,12 +218,14 @@ void Problem::assembleGlobalSystem()
         if(icell->GetStatus() == Element::Ghost)
             continue;
         Cell cell = icell->getAsCell();
+        // The face list comes from INMOST and is still built per cell,
+        // local matrices live in work
         auto faces = cell.getFaces();
         unsigned nf = static_cast<unsigned>(faces.size());
 
         // nf x nf matrix defining flux inner product
-        rMatrix MF;
-        assembleLocalSystem(cell, MF);
+        assembleLocalSystem(cell, faces);
+        raMatrix MF = raMatrixMake(work.MF, nf, nf);
 //        MF.Zero();
 //        for(unsigned i = 0; i < nf; i++)
 //            MF(i,i) = cell.Volume();
@@ -279,71 +310,89 @@ void Problem::assembleGlobalSystem()
     times[T_ASSEMBLE] += Timer() - t;
 }
 
-void Problem::assembleLocalSystem(Cell &cell, rMatrix &MF)
+void Problem::assembleLocalSystem(Cell &cell, const ElementArray<Face> &faces)
 {
-    auto faces = cell.getFaces();
     unsigned nf = static_cast<unsigned>(faces.size());
+    double *NP = work.NP, *RP = work.RP, *MF = work.MF;
 
     double xP[2];
     cell.Barycenter(xP);
 
-    rMatrix D(2,2); // Diffusion tensor
-    D(0,0) = cell.RealArray(tagD)[0];
-    D(1,1) = cell.RealArray(tagD)[1];
-    D(1,0) = cell.RealArray(tagD)[2];
-    D(0,1) = cell.RealArray(tagD)[2];
-
+    // Diffusion tensor
+    Storage::real_array K = cell.RealArray(tagD);
+    double D[2][2] = {{K[0], K[2]}, {K[2], K[1]}};
 
-    rMatrix MP(nf,nf);
-    rMatrix NP(nf,2);
-    rMatrix RP(nf,2);
-    // G   * [pc lam] = MF^(-1) * MAT
-    // axb   (nf+1)x1   nfxnf    nfx1
+    // NP = N * D, where N contains unit normals in rows
     double xf[2], n[2];
     for(unsigned i = 0; i < nf; i++){
         faces[i].Barycenter(xf);
         faces[i].UnitNormal(n);
-        NP(i,0) = n[0];
-        NP(i,1) = n[1];
+        NP[2*i+0] = n[0]*D[0][0] + n[1]*D[1][0];
+        NP[2*i+1] = n[0]*D[0][1] + n[1]*D[1][1];
 
         double a = (cell == faces[i].FrontCell()) ? -1. : 1.;
         a *= faces[i].Area();// / cell.Volume();
-        RP(i,0) = a * (xf[0] - xP[0]);
-        RP(i,1) = a * (xf[1] - xP[1]);
+        RP[2*i+0] = a * (xf[0] - xP[0]);
+        RP[2*i+1] = a * (xf[1] - xP[1]);
+    }
+
+    // A = RP^T * NP, C = NP^T * NP
+    double A[2][2] = {{0., 0.}, {0., 0.}}, C[2][2] = {{0., 0.}, {0., 0.}};
+    for(unsigned i = 0; i < nf; i++){
+        for(unsigned r = 0; r < 2; r++){
+            for(unsigned s = 0; s < 2; s++){
+                A[r][s] += RP[2*i+r] * NP[2*i+s];
+                C[r][s] += NP[2*i+r] * NP[2*i+s];
+            }
+        }
     }
-    NP = NP * D;
-    //NP = D * NP;
 
-    //rMatrix test = NP.Transpose() * RP - cell.Volume() * D;
-    rMatrix test = RP.Transpose()*NP - cell.Volume() * D;
-    double diff;
-    if((diff = test.FrobeniusNorm()) > 1e-3){
+    // Consistency check: RP^T * NP = |P| * D
+    double V = cell.Volume(), diff = 0.0;
+    for(unsigned r = 0; r < 2; r++)
+        for(unsigned s = 0; s < 2; s++)
+            diff += (A[r][s] - V*D[r][s]) * (A[r][s] - V*D[r][s]);
+    if((diff = sqrt(diff)) > 1e-3){
         cout << "Bad test: diff = " << diff << endl;
         exit(1);
     }
-//    test.Print();
-//    exit(1);
-
-    rMatrix MP0(nf,nf), MP1(nf,nf), I(nf,nf);
-//    I.Unit(nf,1.0);
-    I.Zero();
-    for(unsigned i = 0; i < nf; i++)
-        I(i,i) = 1.0;
-    //cout << "tr = " << I.Trace() << endl;
-    //I.Print();
-    //exit(1);
-
-    //MP0 = RP * (1./cell.Volume() * D.Invert()) * RP.Transpose();
-    MP0 = RP * (RP.Transpose()*NP).Invert() * RP.Transpose();
-
-    //double gammaP = 2*(RP * D.Invert() * RP.Transpose()).Trace() / nf / cell.Volume();// * 2.;
-    double gammaP = MP0.Trace() / nf;
-    MP1 = gammaP * (I - NP * (NP.Transpose()*NP).Invert() * NP.Transpose());
-    MP = MP0 + MP1;
-
-    MF = MP;
-//    MF.Print();
-//    cout << endl;
+
+    // Invert both 2x2 matrices in place
+    double detA = A[0][0]*A[1][1] - A[0][1]*A[1][0];
+    double detC = C[0][0]*C[1][1] - C[0][1]*C[1][0];
+    swap(A[0][0], A[1][1]);
+    A[0][1] = -A[0][1];
+    A[1][0] = -A[1][0];
+    swap(C[0][0], C[1][1]);
+    C[0][1] = -C[0][1];
+    C[1][0] = -C[1][0];
+    for(unsigned r = 0; r < 2; r++){
+        for(unsigned s = 0; s < 2; s++){
+            A[r][s] /= detA;
+            C[r][s] /= detC;
+        }
+    }
+
+    // MP0 = RP * (RP^T*NP)^(-1) * RP^T
+    double trace = 0.0;
+    for(unsigned i = 0; i < nf; i++){
+        double ra[2] = {RP[2*i]*A[0][0] + RP[2*i+1]*A[1][0],
+                        RP[2*i]*A[0][1] + RP[2*i+1]*A[1][1]};
+        for(unsigned j = 0; j < nf; j++)
+            MF[i*nf+j] = ra[0]*RP[2*j] + ra[1]*RP[2*j+1];
+        trace += MF[i*nf+i];
+    }
+
+    // MP1 = gammaP * (I - NP * (NP^T*NP)^(-1) * NP^T)
+    double gammaP = trace / nf;
+    for(unsigned i = 0; i < nf; i++){
+        double nc[2] = {NP[2*i]*C[0][0] + NP[2*i+1]*C[1][0],
+                        NP[2*i]*C[0][1] + NP[2*i+1]*C[1][1]};
+        for(unsigned j = 0; j < nf; j++){
+            double proj = nc[0]*NP[2*j] + nc[1]*NP[2*j+1];
+            MF[i*nf+j] += gammaP * ((i == j ? 1. : 0.) - proj);
+        }
+    }
 }
 
 
@@ -1,8 +1,6 @@
 #include "inmost.h"
+#include "vem_local.h"
 
-//    !!!!!!! Currently NOT suited for parallel run
-//
-//
 //    This code solves the following
 //    boundary value problem for diffusion equation
 //
@@ -20,7 +18,12 @@
 //    - init tags,
 //    - assemble linear system,
 //    - solve it with INMOST inner linear solver,
-//    - save solution in a .vtk file.
+//    - save solution in a .vtk file (.pvtk for parallel runs).
+//
+//    In parallel, the mesh is either loaded from a parallel file
+//    or loaded on rank 0 and distributed with the K-means partitioner.
+//    One layer of ghost cells (through nodes) is used, so that every owned
+//    DOF gets contributions from all cells around it.
 
 
 using namespace INMOST;
@@ -41,7 +44,8 @@ const string tagNameRHS    = "RHS";
 const string tagNameSol    = "SOLUTION";
 const string tagNameSolEx  = "SOLUTION_EXACT";
 
-const unsigned n_polys = 3;
+const unsigned n_polys    = 3; // linear monomials, order 1
+const unsigned n_polys_k2 = 6; // quadratic monomials, order 2
 
 
 // Corresponds to tensor
@@ -66,6 +70,159 @@ double exactSolutionRHS(double *x)
     return 0;//M_PI*M_PI * ((Dxx+Dyy) * exactSolution(x) - 2*Dxy*cos(M_PI*x[0])*cos(M_PI*x[1]));
 }
 
+// Scaled monomials up to degree 2 on a polygon:
+// 1, s, t, s^2, st, t^2 with s = (x-xc)/h, t = (y-yc)/h.
+// Fills values and, if grad is not null, gradients (grad[2*a], grad[2*a+1])
+void scaledMonomials2(const double *x, const double *xc, double h, double *val, double *grad)
+{
+    double s = (x[0]-xc[0])/h, t = (x[1]-xc[1])/h;
+    val[0] = 1.;
+    val[1] = s;
+    val[2] = t;
+    val[3] = s*s;
+    val[4] = s*t;
+    val[5] = t*t;
+    if(grad == nullptr)
+        return;
+    double g[2*n_polys_k2] = {0.,     0.,
+                              1./h,   0.,
+                              0.,     1./h,
+                              2*s/h,  0.,
+                              t/h,    s/h,
+                              0.,     2*t/h};
+    for(unsigned k = 0; k < 2*n_polys_k2; k++)
+        grad[k] = g[k];
+}
+
+// Laplacians of scaled monomials times h^2
+const double monomLaplacian2[n_polys_k2] = {0., 0., 0., 2., 0., 2.};
+
+// Projector Pi^nabla of the order 2 virtual element space on a polygon
+// with n vertices given in cyclic order by coordinates (u[2*i], u[2*i+1]).
+// Local DOFs are vertex values, values at midpoints of edges (i,i+1)
+// and the polygon average, 2n+1 in total.
+// Fills D ((2n+1) x 6), B and Proj (6 x (2n+1)) and G = B*D (6 x 6),
+// returns area, centroid and diameter used to scale the monomials.
+bool polygonProjectorK2(const double *u, unsigned n,
+                        double *D, double *B, double *G, double *Proj,
+                        double &area, double *uc, double &h)
+{
+    const unsigned np = n_polys_k2, nd = 2*n+1;
+
+    // Signed area and centroid
+    double sa = 0.;
+    uc[0] = uc[1] = 0.;
+    for(unsigned i = 0; i < n; i++){
+        unsigned j = (i+1) % n;
+        double cr = u[2*i]*u[2*j+1] - u[2*j]*u[2*i+1];
+        sa    += cr;
+        uc[0] += (u[2*i]   + u[2*j])   * cr;
+        uc[1] += (u[2*i+1] + u[2*j+1]) * cr;
+    }
+    sa *= 0.5;
+    uc[0] /= 6.*sa;
+    uc[1] /= 6.*sa;
+    double orient = sa > 0. ? 1. : -1.;
+    area = fabs(sa);
+
+    h = 0.;
+    for(unsigned i = 0; i < n; i++)
+        for(unsigned j = i+1; j < n; j++)
+            h = max(h, (u[2*i]-u[2*j])*(u[2*i]-u[2*j]) + (u[2*i+1]-u[2*j+1])*(u[2*i+1]-u[2*j+1]));
+    h = sqrt(h);
+
+    // D: monomials at vertices, edge midpoints and their averages.
+    // Averages are integrated over triangles (uc, u_i, u_{i+1})
+    // with the edge midpoint rule, exact for quadratics
+    double val[n_polys_k2], grad[2*n_polys_k2];
+    double *Davg = D + 2*n*np;
+    for(unsigned a = 0; a < np; a++)
+        Davg[a] = 0.;
+    for(unsigned i = 0; i < n; i++){
+        unsigned j = (i+1) % n;
+        double mid[2] = {0.5*(u[2*i]+u[2*j]), 0.5*(u[2*i+1]+u[2*j+1])};
+        scaledMonomials2(u + 2*i, uc, h, D + i*np, nullptr);
+        scaledMonomials2(mid, uc, h, D + (n+i)*np, nullptr);
+
+        double st = 0.5 * orient * ((u[2*i]-uc[0])*(u[2*j+1]-uc[1]) - (u[2*j]-uc[0])*(u[2*i+1]-uc[1]));
+        double q[3][2] = {{0.5*(uc[0]+u[2*i]), 0.5*(uc[1]+u[2*i+1])},
+                          {mid[0], mid[1]},
+                          {0.5*(uc[0]+u[2*j]), 0.5*(uc[1]+u[2*j+1])}};
+        for(unsigned k = 0; k < 3; k++){
+            scaledMonomials2(q[k], uc, h, val, nullptr);
+            for(unsigned a = 0; a < np; a++)
+                Davg[a] += st/3. * val[a];
+        }
+    }
+    for(unsigned a = 0; a < np; a++)
+        Davg[a] /= area;
+
+    // B(0,:) = P0 is the average DOF,
+    // B(a,:) = int_dE grad m_a * n phi - int_E lap m_a phi otherwise.
+    // Boundary integrals use 3-point Gauss-Lobatto rule on each edge
+    for(unsigned k = 0; k < np*nd; k++)
+        B[k] = 0.;
+    B[nd-1] = 1.;
+    for(unsigned i = 0; i < n; i++){
+        unsigned j = (i+1) % n;
+        double d[2] = {u[2*j]-u[2*i], u[2*j+1]-u[2*i+1]};
+        double L = sqrt(d[0]*d[0] + d[1]*d[1]);
+        double nor[2] = {orient*d[1]/L, -orient*d[0]/L};
+        double mid[2] = {0.5*(u[2*i]+u[2*j]), 0.5*(u[2*i+1]+u[2*j+1])};
+        const double *pts[3] = {u + 2*i, mid, u + 2*j};
+        unsigned ids[3] = {i, n+i, j};
+        double wts[3] = {L/6., 4.*L/6., L/6.};
+        for(unsigned k = 0; k < 3; k++){
+            scaledMonomials2(pts[k], uc, h, val, grad);
+            for(unsigned a = 1; a < np; a++)
+                B[a*nd+ids[k]] += wts[k] * (grad[2*a]*nor[0] + grad[2*a+1]*nor[1]);
+        }
+    }
+    for(unsigned a = 1; a < np; a++)
+        B[a*nd+nd-1] -= monomLaplacian2[a] / (h*h) * area;
+
+    // G = B*D, Proj = G^(-1) * B
+    double Ginv[n_polys_k2*n_polys_k2];
+    for(unsigned a = 0; a < np; a++){
+        for(unsigned c = 0; c < np; c++){
+            G[a*np+c] = 0.;
+            for(unsigned i = 0; i < nd; i++)
+                G[a*np+c] += B[a*nd+i] * D[i*np+c];
+            Ginv[a*np+c] = G[a*np+c];
+        }
+    }
+    if(!invertSmallMatrix(Ginv, np))
+        return false;
+    for(unsigned a = 0; a < np; a++){
+        for(unsigned i = 0; i < nd; i++){
+            Proj[a*nd+i] = 0.;
+            for(unsigned c = 0; c < np; c++)
+                Proj[a*nd+i] += Ginv[a*np+c] * B[c*nd+i];
+        }
+    }
+    return true;
+}
+
+// Workspace of the 2D kernels, see VemWorkspace
+class LocalWorkspace : public VemWorkspace
+{
+private:
+    vector<HandleType> hbuf;
+public:
+    double *u;      // 2 x nn, node coordinates
+    HandleType *fh; // nn, order 2: face (edge) between nodes i and i+1
+
+    LocalWorkspace() : u(nullptr), fh(nullptr) {}
+    // nn - max number of nodes, nd - max number of DOFs per cell,
+    // np - number of monomials
+    void init(unsigned nn, unsigned nd, unsigned np)
+    {
+        u = initCommon(static_cast<int>(nd), static_cast<int>(np), static_cast<int>(2*nn));
+        hbuf.assign(nn, InvalidHandle());
+        fh = hbuf.data();
+    }
+};
+
 class Problem
 {
 private:
@@ -76,8 +233,10 @@ private:
     Tag tagSol;   // Solution
     Tag tagSolEx; // Exact solution
 
-    MarkerType mrkDirNode;  // Dirichlet node marker
-    MarkerType mrkUnknwn;
+    MarkerType mrkDirNode;  // Dirichlet node (or edge) marker
+
+    unsigned order;         // VEM order, 1 or 2
+    ElementType dofTypes;   // Elements carrying DOFs
 
     Automatizator aut;    // Automatizator to handle all AD things
     Residual R;           // Residual to assemble
@@ -85,66 +244,117 @@ private:
 
     int rank; // for parallel runs
 
-    unsigned numDirNodes;
+    int numDirNodes;
+    bool restarted; // Solution is loaded from a checkpoint
+
+    LocalWorkspace work;  // Storage for local matrices
+    ElementArray<Element> dofs; // Local DOFs of the current cell, reused between cells
 
     double times[10];
     double ttt; // global timer
 
 public:
-    Problem(string meshName);
+    Problem(string meshName, unsigned vemOrder = 1);
     ~Problem();
-    void initProblem(); // create tags and set parameters
+    void initProblem(bool restart = false); // create tags and set parameters, restart keeps loaded solution
     void assembleGlobalSystem(); // assemble global linear system
     rMatrix computeW(Cell &);
     rMatrix integrateRHS(Cell &);
-    void assembleLocalSystem(Cell &, rMatrix &, rMatrix &);
+    void collectLocalDofs(Cell &, const ElementArray<Node> &); // fills dofs
+    void assembleLocalSystem(Cell &, const ElementArray<Node> &); // fills work.W, work.b
+    void assembleLocalSystemK2(Cell &, const ElementArray<Element> &); // same for order 2
     void solveSystem();
-    void saveSolution(string path); // save mesh with solution
+    void saveSolution(string prefix); // save mesh with solution
+    void saveWithout(string path, const Tag *skip, unsigned nskip); // save mesh without given tags
+    void saveCheckpoint(string prefix); // save solution tags only in binary parallel format, call last
 };
 
-Problem::Problem(string meshName)
+Problem::Problem(string meshName, unsigned vemOrder)
 {
     ttt = Timer();
+    order = vemOrder;
+    // Order 2 adds edge midpoint values (on faces, as edges are faces in 2D)
+    // and cell averages to vertex values
+    dofTypes = (order == 2) ? (NODE|FACE|CELL) : NODE;
     for(int i = 0; i < 10; i++)
         times[i] = 0.;
 
+    m.SetCommunicator(INMOST_MPI_COMM_WORLD);
     rank = m.GetProcessorRank();
 
     double t = Timer();
-    if(rank == 0){
+    // Parallel files (see partition_mesh) are already partitioned,
+    // every rank loads its own part. They are repartitioned only
+    // if they were written for another number of processes
+    bool partitioned = false;
+    if(m.isParallelFileFormat(meshName)){
+        m.Load(meshName);
+        int nonEmpty = m.Integrate(m.NumberOfCells() > 0 ? 1 : 0);
+        partitioned = (nonEmpty == m.GetProcessorsNumber());
+    }
+    else if(rank == 0){
         m.Load(meshName);
         cout << "Number of cells: " << m.NumberOfCells() << endl;
         cout << "Number of faces: " << m.NumberOfFaces() << endl;
         cout << "Number of edges: " << m.NumberOfEdges() << endl;
         cout << "Number of nodes: " << m.NumberOfNodes() << endl;
     }
+
+    if(m.GetProcessorsNumber() > 1){
+        if(!partitioned){
+            Partitioner part(&m);
+            part.SetMethod(Partitioner::INNER_KMEANS, Partitioner::Partition);
+            part.Evaluate();
+            m.Redistribute();
+        }
+        m.AssignGlobalID(NODE);
+        m.ExchangeGhost(1, NODE);
+    }
+    else
+        m.AssignGlobalID(NODE);
     times[T_IO] += Timer() - t;
 }
 
 Problem::~Problem()
 {
-    printf("\n+=========================\n");
-    printf("| T_assemble = %lf\n", times[T_ASSEMBLE]);
-    printf("| T_precond  = %lf\n", times[T_PRECOND]);
-    printf("| T_solve    = %lf\n", times[T_SOLVE]);
-    printf("| T_IO       = %lf\n", times[T_IO]);
-    printf("| T_update   = %lf\n", times[T_UPDATE]);
-    printf("| T_init     = %lf\n", times[T_INIT]);
-    printf("+-------------------------\n");
-    printf("| T_total    = %lf\n", Timer() - ttt);
-    printf("+=========================\n");
+    m.AggregateMax(times, 10);
+    if(rank == 0){
+        printf("\n+=========================\n");
+        printf("| T_assemble = %lf\n", times[T_ASSEMBLE]);
+        printf("| T_precond  = %lf\n", times[T_PRECOND]);
+        printf("| T_solve    = %lf\n", times[T_SOLVE]);
+        printf("| T_IO       = %lf\n", times[T_IO]);
+        printf("| T_update   = %lf\n", times[T_UPDATE]);
+        printf("| T_init     = %lf\n", times[T_INIT]);
+        printf("+-------------------------\n");
+        printf("| T_total    = %lf\n", Timer() - ttt);
+        printf("+=========================\n");
+    }
 }
 
-void Problem::initProblem()
+void Problem::initProblem(bool restart)
 {
     double t = Timer();
+    // On restart the solution of a checkpoint is the initial guess
+    restarted = restart;
+    if(restarted && !m.HaveTag(tagNameSol)){
+        if(rank == 0)
+            cout << "Restart requested, but mesh has no " << tagNameSol << " tag" << endl;
+        exit(1);
+    }
+    if(restarted && rank == 0)
+        cout << "Restart from loaded solution" << endl;
     tagD     = m.CreateTag(tagNameTensor, DATA_REAL, CELL, NONE, 3);
-    tagBC    = m.CreateTag(tagNameBC,     DATA_REAL, NODE, NODE, 1);
-    tagSol   = m.CreateTag(tagNameSol,    DATA_REAL, NODE, NONE, 1);
-    tagSolEx = m.CreateTag(tagNameSolEx,  DATA_REAL, NODE, NONE, 1);
-
-    // Set diffusion tensor
+    tagBC    = m.CreateTag(tagNameBC,     DATA_REAL, dofTypes & (NODE|FACE), dofTypes & (NODE|FACE), 1);
+    tagSol   = m.CreateTag(tagNameSol,    DATA_REAL, dofTypes, NONE, 1);
+    tagSolEx = m.CreateTag(tagNameSolEx,  DATA_REAL, dofTypes, NONE, 1);
+
+    // Set diffusion tensor,
+    // also find the largest number of nodes per cell,
+    // ghost cells are assembled too
+    unsigned maxnn = 0;
     for(auto icell = m.BeginCell(); icell != m.EndCell(); icell++){
+        maxnn = max(maxnn, icell->nbAdjElements(NODE));
         if(icell->GetStatus() == Element::Ghost)
             continue;
 
@@ -153,39 +363,53 @@ void Problem::initProblem()
         icell->RealArray(tagD)[2] = Dxy; // Dxy
     }
     m.ExchangeData(tagD, CELL);
+    if(order == 2)
+        work.init(maxnn, 2*maxnn+1, n_polys_k2);
+    else
+        work.init(maxnn, maxnn, n_polys);
+    dofs = ElementArray<Element>(&m);
+    dofs.reserve(order == 2 ? 2*maxnn+1 : maxnn);
 
     // Set boundary conditions
-    // Mark and count Dirichlet nodes
-    // Compute RHS and exact solution
+    // Mark and count Dirichlet nodes (and edges for order 2)
+    // Compute RHS and exact solution.
+    // Ghost DOFs are marked too as they enter local systems,
+    // MarkBoundaryFaces does not mark faces on the ghost layer border
     numDirNodes = 0;
     mrkDirNode = m.CreateMarker();
-    mrkUnknwn = m.CreateMarker();
-    for(auto inode = m.BeginNode(); inode != m.EndNode(); inode++){
-        if(inode->GetStatus() == Element::Ghost)
-            continue;
-
-        Node node = inode->getAsNode();
+    m.MarkBoundaryFaces(mrkDirNode);
+    for(auto inode = m.BeginElement(dofTypes); inode != m.EndElement(); inode++){
+        Element node = inode->self();
         double x[2];
         node.Barycenter(x);
 
         node.Real(tagSolEx) = exactSolution(x);
-        node.Real(tagSol) = 10;
+        if(!restarted)
+            node.Real(tagSol) = 10;
 
-        if(!node.Boundary()){
-            node->SetMarker(mrkUnknwn);
+        // Cell averages are always unknown, boundary faces are marked already
+        if(node.GetElementType() == CELL)
             continue;
+        if(node.GetElementType() == NODE){
+            if(!node.nbAdjElements(FACE, mrkDirNode))
+                continue;
+            node.SetMarker(mrkDirNode);
         }
+        else if(!node.GetMarker(mrkDirNode))
+            continue;
 
-        node.SetMarker(mrkDirNode);
-        numDirNodes++;
+        if(node.GetStatus() != Element::Ghost)
+            numDirNodes++;
         node.Real(tagBC)  = exactSolution(x);
     }
-    cout << "Number of Dirichlet nodes: " << numDirNodes << endl;
+    numDirNodes = m.Integrate(numDirNodes);
+    if(rank == 0)
+        cout << "Number of Dirichlet nodes: " << numDirNodes << endl;
 
     Automatizator::MakeCurrent(&aut);
 
     INMOST_DATA_ENUM_TYPE SolTagEntryIndex = 0;
-    SolTagEntryIndex = aut.RegisterTag(tagSol, NODE, mrkUnknwn);
+    SolTagEntryIndex = aut.RegisterTag(tagSol, dofTypes, mrkDirNode, true);
     var = dynamic_variable(aut, SolTagEntryIndex);
     aut.EnumerateEntries();
     R = Residual("fem_diffusion", aut.GetFirstIndex(), aut.GetLastIndex());
@@ -195,26 +419,33 @@ void Problem::initProblem()
 void Problem::assembleGlobalSystem()
 {
     double t = Timer();
+    // Ghost cells are assembled as well, only rows of owned DOFs are filled
     for(auto icell = m.BeginCell(); icell != m.EndCell(); icell++){
-        if(icell->GetStatus() == Element::Ghost)
-            continue;
         Cell cell = icell->getAsCell();
 
-        ElementArray<Node> nodes = icell->getNodes();
-        rMatrix rhs, W;
-        assembleLocalSystem(cell, W, rhs);
-
+        // Adjacency queries still return fresh arrays from INMOST,
+        // the DOF list itself reuses dofs
+        ElementArray<Node> cnodes = cell.getNodes();
+        collectLocalDofs(cell, cnodes);
+        const ElementArray<Element> &nodes = dofs;
         auto nnodes = nodes.size();
 
+        if(order == 2)
+            assembleLocalSystemK2(cell, nodes);
+        else
+            assembleLocalSystem(cell, cnodes);
+        raMatrix W   = raMatrixMake(work.W, nnodes, nnodes);
+        raMatrix rhs = raMatrixMake(work.b, nnodes, 1);
+
         for(unsigned i = 0; i != nnodes; i++){
-            if(nodes[i]->GetMarker(mrkDirNode)){
+            if(nodes[i].GetMarker(mrkDirNode)){
                 double bcVal = nodes[i].Real(tagBC);
                 for(unsigned j = 0; j != nnodes; j++)
-                    if(!nodes[j].GetMarker(mrkDirNode)){
+                    if(nodes[j].GetStatus() != Element::Ghost && !nodes[j].GetMarker(mrkDirNode)){
                         R[var.Index(nodes[j])] += bcVal * W(j,i);
                     }
             }
-            else{
+            else if(nodes[i].GetStatus() != Element::Ghost){
                 // Node with unknown
                 for(unsigned j = 0; j != nnodes; j++)
                     if(!nodes[j].GetMarker(mrkDirNode))
@@ -227,92 +458,203 @@ void Problem::assembleGlobalSystem()
 }
 
 
-void Problem::assembleLocalSystem(Cell &cell, rMatrix &W, rMatrix &b)
+// Local DOFs in the order expected by the local kernels:
+// cell nodes, then for order 2 faces (edges) connecting nodes i and i+1
+// and the cell itself
+void Problem::collectLocalDofs(Cell &cell, const ElementArray<Node> &nodes)
+{
+    dofs.clear();
+    unsigned nn = static_cast<unsigned>(nodes.size());
+    for(unsigned i = 0; i < nn; i++)
+        dofs.push_back(nodes[i]);
+    if(order != 2)
+        return;
+
+    // One pass over faces: each face is put into the slot
+    // of the node pair it connects
+    ElementArray<Face> faces = cell.getFaces();
+    fill(work.fh, work.fh + nn, InvalidHandle());
+    for(unsigned k = 0; k < faces.size(); k++){
+        ElementArray<Node> fn = faces[k].getNodes();
+        for(unsigned i = 0; i < nn; i++){
+            Node a = nodes[i], b = nodes[(i+1) % nn];
+            if((fn[0] == a && fn[1] == b) || (fn[0] == b && fn[1] == a)){
+                work.fh[i] = faces[k].GetHandle();
+                break;
+            }
+        }
+    }
+    for(unsigned i = 0; i < nn; i++){
+        if(work.fh[i] == InvalidHandle()){
+            cout << "Cell " << cell.LocalID() << ": edges do not match nodes" << endl;
+            exit(1);
+        }
+        dofs.push_back(Face(&m, work.fh[i]));
+    }
+    dofs.push_back(cell);
+}
+
+void Problem::assembleLocalSystem(Cell &cell, const ElementArray<Node> &nodes)
 {
-    auto nodes = cell.getNodes();
-    auto faces = cell.getFaces();
     unsigned nn = static_cast<unsigned>(nodes.size());
-    if(faces.size() != nodes.size())
+    if(cell.nbAdjElements(FACE) != nn)
         exit(1);
+    double *D = work.D, *B = work.B, *Proj = work.Proj, *GP = work.GP;
+    double *Se = work.Se, *W = work.W, *b = work.b;
+
     double xc[2], diam = 0.;
     cell.Centroid(xc);
-    for(auto it = nodes.begin(); it != nodes.end(); it++){
-        auto xi = it->Coords();
-        for(auto jt = nodes.begin(); jt != nodes.end(); jt++){
-            auto xj = jt->Coords();
+    for(unsigned i = 0; i < nn; i++){
+        auto xi = nodes[i].Coords();
+        for(unsigned j = i+1; j < nn; j++){
+            auto xj = nodes[j].Coords();
             diam = max(diam, (xi[0]-xj[0])*(xi[0]-xj[0]) + (xi[1]-xj[1])*(xi[1]-xj[1]));
         }
     }
     diam = sqrt(diam);
-    //printf("Cell %d (%lf, %lf): nn = %d, diam = %e\n", cell.DataLocalID(), xc[0],xc[1], nn, diam);
-    rMatrix D(nn, n_polys), B(n_polys, nn);
-    B.Zero();
-    D.Zero();
-    for(unsigned i = 0; i < nn; i++){
-        D(i,0) = 1.0;
-    }
+
+    // D(i,a) = m_a(x_i), B(a,i) = P0(phi_i) for a = 0,
+    //                             int grad m_a * grad phi_i otherwise
     for(unsigned i = 0; i < nn; i++){
-        B(0,i) = 1.0/nn;
+        D[i*n_polys] = 1.0;
+        B[i] = 1.0/nn;
     }
-
     for(unsigned vid = 0; vid < nn; vid++){
-        Node n = nodes[vid];
         unsigned indprev = vid == 0 ? nn-1 : vid-1;
         unsigned indnext = vid == nn-1 ? 0 : vid+1;
-        Node prev = nodes[indprev];
-        Node next = nodes[indnext];
+        auto xv = nodes[vid].Coords();
+        auto xp = nodes[indprev].Coords();
+        auto xn = nodes[indnext].Coords();
         double nor[2];
-        auto xv = n.Coords();
-        auto xp = prev.Coords();
-        auto xn = next.Coords();
         nor[0] = xn[1] - xp[1];
         nor[1] = xp[0] - xn[0];
 
-        //printf("node %d (%e, %e)\n", vid, xv[0], xv[1]);
-        //printf("node %d, n = (%lf, %lf)\n", vid, nor[0], nor[1]);
-        //printf("node %d, prev = %d, next = %d\n", vid, indprev, indnext);
-
+        // Scaled monomials (x-xc)/diam and (y-yc)/diam
+        // have constant gradients e_x/diam and e_y/diam
         for(unsigned i = 1; i < n_polys; i++){
-            double polygrad[2];
-            if(i == 1){
-                polygrad[0] = 1.;
-                polygrad[1] = 0.;
-            }
-            else if(i == 2){
-                polygrad[0] = 0.;
-                polygrad[1] = 1.;
-            }
-            rMatrix monomgrad(2,1);
-            monomgrad(0,0) = polygrad[0] / diam;
-            monomgrad(1,0) = polygrad[1] / diam;
-            //monomgrad.Print();
-            D(vid,i) = (xv[0]-xc[0])*polygrad[0] + (xv[1]-xc[1])*polygrad[1];
-            D(vid,i) /= diam;
-            B(i, vid) = 0.5 * (monomgrad(0,0)*nor[0] + monomgrad(1,0)*nor[1]);
+            D[vid*n_polys+i] = (xv[i-1] - xc[i-1]) / diam;
+            B[i*nn+vid] = 0.5 * nor[i-1] / diam;
         }
     }
-    //B.Print();
-    rMatrix Proj = (B*D).Invert() * B;
-    rMatrix Se(nn,nn);
-    Se.Zero();
-    for(unsigned i = 0; i < nn; i++)
-        Se(i,i) = 1.;
-    Se = Se - D*Proj;
-    Se = Se.Transpose() * Se;
-    rMatrix G = B*D;
-    for(unsigned i = 0; i < G.Cols(); i++)
-        G(0,i) = 0;
-    W = Proj.Transpose() * G * Proj + Se;
-
-    //W.Print();
-    //exit(1);
-    b = rMatrix(nn,1);
+
+    // G = B*D, Proj = G^(-1) * B
+    double G[n_polys*n_polys], Ginv[n_polys*n_polys];
+    for(unsigned a = 0; a < n_polys; a++){
+        for(unsigned c = 0; c < n_polys; c++){
+            G[a*n_polys+c] = 0.;
+            for(unsigned i = 0; i < nn; i++)
+                G[a*n_polys+c] += B[a*nn+i] * D[i*n_polys+c];
+            Ginv[a*n_polys+c] = G[a*n_polys+c];
+        }
+    }
+    if(!invertSmallMatrix(Ginv, n_polys)){
+        cout << "Singular B*D matrix in cell " << cell.LocalID() << endl;
+        exit(1);
+    }
+    for(unsigned a = 0; a < n_polys; a++){
+        for(unsigned i = 0; i < nn; i++){
+            Proj[a*nn+i] = 0.;
+            for(unsigned c = 0; c < n_polys; c++)
+                Proj[a*nn+i] += Ginv[a*n_polys+c] * B[c*nn+i];
+        }
+    }
+
+    // Se = I - D*Proj
+    for(unsigned i = 0; i < nn; i++){
+        for(unsigned j = 0; j < nn; j++){
+            double dp = 0.;
+            for(unsigned a = 0; a < n_polys; a++)
+                dp += D[i*n_polys+a] * Proj[a*nn+j];
+            Se[i*nn+j] = (i == j ? 1. : 0.) - dp;
+        }
+    }
+
+    // Consistency part uses G with zeroed first row
+    for(unsigned c = 0; c < n_polys; c++)
+        G[c] = 0.;
+    for(unsigned a = 0; a < n_polys; a++){
+        for(unsigned j = 0; j < nn; j++){
+            GP[a*nn+j] = 0.;
+            for(unsigned c = 0; c < n_polys; c++)
+                GP[a*nn+j] += G[a*n_polys+c] * Proj[c*nn+j];
+        }
+    }
+
+    // W = Proj^T * G * Proj + Se^T * Se
+    for(unsigned i = 0; i < nn; i++){
+        for(unsigned j = 0; j < nn; j++){
+            double w = 0.;
+            for(unsigned a = 0; a < n_polys; a++)
+                w += Proj[a*nn+i] * GP[a*nn+j];
+            for(unsigned k = 0; k < nn; k++)
+                w += Se[k*nn+i] * Se[k*nn+j];
+            W[i*nn+j] = w;
+        }
+    }
+
     double rhs = exactSolutionRHS(xc) * cell.Volume() / nn;
     for(unsigned i = 0; i < nn; i++){
-        b(i,0) = rhs;
+        b[i] = rhs;
     }
 }
 
+void Problem::assembleLocalSystemK2(Cell &cell, const ElementArray<Element> &dofs)
+{
+    unsigned nd = static_cast<unsigned>(dofs.size()), nn = (nd-1)/2;
+    const unsigned np = n_polys_k2;
+    double *D = work.D, *B = work.B, *Proj = work.Proj, *GP = work.GP;
+    double *Se = work.Se, *W = work.W, *b = work.b, *u = work.u;
+
+    for(unsigned i = 0; i < nn; i++){
+        auto x = dofs[i].getAsNode().Coords();
+        u[2*i]   = x[0];
+        u[2*i+1] = x[1];
+    }
+    double G[n_polys_k2*n_polys_k2], area, xc[2], diam;
+    if(!polygonProjectorK2(u, nn, D, B, G, Proj, area, xc, diam)){
+        cout << "Singular B*D matrix in cell " << cell.LocalID() << endl;
+        exit(1);
+    }
+
+    // Se = I - D*Proj
+    for(unsigned i = 0; i < nd; i++){
+        for(unsigned j = 0; j < nd; j++){
+            double dp = 0.;
+            for(unsigned a = 0; a < np; a++)
+                dp += D[i*np+a] * Proj[a*nd+j];
+            Se[i*nd+j] = (i == j ? 1. : 0.) - dp;
+        }
+    }
+
+    // Consistency part uses G with zeroed first row
+    for(unsigned c = 0; c < np; c++)
+        G[c] = 0.;
+    for(unsigned a = 0; a < np; a++){
+        for(unsigned j = 0; j < nd; j++){
+            GP[a*nd+j] = 0.;
+            for(unsigned c = 0; c < np; c++)
+                GP[a*nd+j] += G[a*np+c] * Proj[c*nd+j];
+        }
+    }
+
+    // W = Proj^T * G * Proj + Se^T * Se
+    for(unsigned i = 0; i < nd; i++){
+        for(unsigned j = 0; j < nd; j++){
+            double w = 0.;
+            for(unsigned a = 0; a < np; a++)
+                w += Proj[a*nd+i] * GP[a*nd+j];
+            for(unsigned k = 0; k < nd; k++)
+                w += Se[k*nd+i] * Se[k*nd+j];
+            W[i*nd+j] = w;
+        }
+    }
+
+    // Load is tested only with the cell average DOF
+    for(unsigned i = 0; i < nd; i++)
+        b[i] = 0.;
+    b[nd-1] = exactSolutionRHS(xc) * area;
+}
+
 void Problem::solveSystem()
 {
     Solver S("inner_mptiluc");
@@ -355,45 +697,102 @@ void Problem::solveSystem()
     bool solved = S.Solve(R.GetResidual(), sol);
     times[T_SOLVE] += Timer() - t;
     if(!solved){
-        cout << "Linear solver failed: " << S.GetReason() << endl;
-        cout << "Residual: " << S.Residual() << endl;
+        if(rank == 0){
+            cout << "Linear solver failed: " << S.GetReason() << endl;
+            cout << "Residual: " << S.Residual() << endl;
+        }
         exit(1);
     }
-    cout << "Linear solver iterations: " << S.Iterations() << endl;
+    if(rank == 0)
+        cout << "Linear solver iterations: " << S.Iterations() << endl;
 
     t = Timer();
     double Cnorm = 0.0;
-    for(auto inode = m.BeginNode(); inode != m.EndNode(); inode++){
-        if(inode->GetMarker(mrkDirNode))
+    for(auto inode = m.BeginElement(dofTypes); inode != m.EndElement(); inode++){
+        if(inode->GetStatus() == Element::Ghost || inode->GetMarker(mrkDirNode))
             continue;
 
-        inode->Real(tagSol) -= sol[var.Index(inode->getAsNode())];
-        Cnorm = max(Cnorm, fabs(inode->Real(tagSol)-inode->Real(tagSolEx)));
+        inode->Real(tagSol) -= sol[var.Index(inode->self())];
+        // Cell averages are not pointwise values, skip them in the C-norm
+        if(inode->GetElementType() != CELL)
+            Cnorm = max(Cnorm, fabs(inode->Real(tagSol)-inode->Real(tagSolEx)));
     }
-    cout << "|err|_C = " << Cnorm << endl;
+    m.ExchangeData(tagSol, dofTypes);
+    Cnorm = m.AggregateMax(Cnorm);
+    if(rank == 0)
+        cout << "|err|_C = " << Cnorm << endl;
     times[T_UPDATE] += Timer() - t;
 }
 
-void Problem::saveSolution(string path)
+void Problem::saveSolution(string prefix)
 {
     double t = Timer();
+    string extension = m.GetProcessorsNumber() > 1 ? ".pvtk" : ".vtk";
+    m.Save(prefix + extension);
+    times[T_IO] += Timer() - t;
+}
+
+// File options of skipped tags are restored after saving
+void Problem::saveWithout(string path, const Tag *skip, unsigned nskip)
+{
+    vector<string> prev(nskip);
+    for(unsigned k = 0; k < nskip; k++){
+        prev[k] = m.GetFileOption("Tag:" + skip[k].GetTagName());
+        m.SetFileOption("Tag:" + skip[k].GetTagName(), "nosave");
+    }
     m.Save(path);
+    for(unsigned k = 0; k < nskip; k++)
+        m.SetFileOption("Tag:" + skip[k].GetTagName(), prev[k]);
+}
+
+// Writes INMOST binary parallel file (.pmf) without the ghost layer,
+// it can be loaded with -restart on the same or another number of processes.
+// Tensor and boundary conditions are recomputed in initProblem
+void Problem::saveCheckpoint(string prefix)
+{
+    double t = Timer();
+    if(m.GetProcessorsNumber() > 1)
+        m.RemoveGhost();
+    Tag skip[] = {tagD, tagBC};
+    saveWithout(prefix + ".pmf", skip, 2);
     times[T_IO] += Timer() - t;
 }
 
 
 int main(int argc, char *argv[])
 {
-    if(argc != 2){
-        cout << "Usage: 2d_diffusion_vem <mesh_file>" << endl;
+    // Optional last argument -restart takes the solution from the mesh file
+    bool restart = (argc >= 3 && string(argv[argc-1]) == "-restart");
+    int npos = restart ? argc-1 : argc; // number of positional arguments
+    if(npos < 2 || npos > 4){
+        cout << "Usage: 2d_diffusion_vem <mesh_file> [order (1 or 2)] [output (vtk or pmf)] [-restart]" << endl;
+        return 1;
+    }
+    unsigned order = (npos >= 3) ? atoi(argv[2]) : 1;
+    string output = (npos == 4) ? argv[3] : "vtk";
+    if((order != 1 && order != 2) || (output != "vtk" && output != "pmf")){
+        cout << "Usage: 2d_diffusion_vem <mesh_file> [order (1 or 2)] [output (vtk or pmf)] [-restart]" << endl;
         return 1;
     }
 
-    Problem P(argv[1]);
-    P.initProblem();
-    P.assembleGlobalSystem();
-    P.solveSystem();
-    P.saveSolution("res.vtk");
+    Solver::Initialize(&argc, &argv, "database.xml");
+    Mesh::Initialize(&argc, &argv);
+    Partitioner::Initialize(&argc, &argv);
+
+    // Problem has to be destroyed before MPI is finalized
+    Problem *P = new Problem(argv[1], order);
+    P->initProblem(restart);
+    P->assembleGlobalSystem();
+    P->solveSystem();
+    if(output == "pmf")
+        P->saveCheckpoint("res");
+    else
+        P->saveSolution("res");
+    delete P;
+
+    Partitioner::Finalize();
+    Solver::Finalize();
+    Mesh::Finalize();
 
     return 0;
 }
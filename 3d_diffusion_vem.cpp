@@ -1,4 +1,5 @@
 #include "inmost.h"
+#include "vem_local.h"
 
 //    !!!!!!! Currently NOT suited for parallel run
 //
@@ -40,8 +41,15 @@ const std::string tagNameBC     = "BOUNDARY_CONDITION";
 const std::string tagNameRHS    = "RHS";
 const std::string tagNameSol    = "SOLUTION";
 const std::string tagNameSolEx  = "SOLUTION_EXACT";
+const std::string tagNameVemGeom = "VEM_GEOMETRY";
+const std::string tagNameVemG    = "VEM_G";
+const std::string tagNameVemProj = "VEM_PROJECTOR";
+const std::string tagNameVemStab = "VEM_STABILIZATION";
 
-const int n_polys = 4;
+const int n_polys    = 4;  // linear monomials, order 1
+const int n_polys_k2 = 10; // quadratic monomials, order 2
+const int n_polys_f2 = 6;  // quadratic monomials on a face, order 2
+static_assert(n_polys_k2 <= vem_max_polys, "invertSmallMatrix is too small for order 2");
 
 
 // Corresponds to tensor
@@ -75,6 +83,303 @@ double exactSolutionRHS(double *x)
 		    );
 }
 
+// Scaled monomials up to degree 2 on a polygon (face):
+// 1, s, t, s^2, st, t^2 with s = (x-xc)/h, t = (y-yc)/h.
+// Fills values and, if grad is not NULL, gradients (grad[2*a], grad[2*a+1])
+void scaledMonomials2(const double *x, const double *xc, double h, double *val, double *grad)
+{
+    double s = (x[0]-xc[0])/h, t = (x[1]-xc[1])/h;
+    val[0] = 1.0;
+    val[1] = s;
+    val[2] = t;
+    val[3] = s*s;
+    val[4] = s*t;
+    val[5] = t*t;
+    if(grad == NULL)
+	    return;
+    double g[2*n_polys_f2] = {0.0,     0.0,
+			      1.0/h,   0.0,
+			      0.0,     1.0/h,
+			      2*s/h,   0.0,
+			      t/h,     s/h,
+			      0.0,     2*t/h};
+    std::copy(g, g + 2*n_polys_f2, grad);
+}
+
+// Scaled monomials up to degree 2 on a polyhedron:
+// 1, s, t, r, s^2, st, sr, t^2, tr, r^2 with (s,t,r) = (x-xc)/h.
+// Fills values and, if grad is not NULL, gradients (grad[3*a+d])
+void scaledMonomials3(const double *x, const double *xc, double h, double *val, double *grad)
+{
+    double p[3] = {(x[0]-xc[0])/h, (x[1]-xc[1])/h, (x[2]-xc[2])/h};
+    val[0] = 1.0;
+    val[1] = p[0];
+    val[2] = p[1];
+    val[3] = p[2];
+    val[4] = p[0]*p[0];
+    val[5] = p[0]*p[1];
+    val[6] = p[0]*p[2];
+    val[7] = p[1]*p[1];
+    val[8] = p[1]*p[2];
+    val[9] = p[2]*p[2];
+    if(grad == NULL)
+	    return;
+    double g[3*n_polys_k2] = {0.0,       0.0,       0.0,
+			      1.0/h,     0.0,       0.0,
+			      0.0,       1.0/h,     0.0,
+			      0.0,       0.0,       1.0/h,
+			      2*p[0]/h,  0.0,       0.0,
+			      p[1]/h,    p[0]/h,    0.0,
+			      p[2]/h,    0.0,       p[0]/h,
+			      0.0,       2*p[1]/h,  0.0,
+			      0.0,       p[2]/h,    p[1]/h,
+			      0.0,       0.0,       2*p[2]/h};
+    std::copy(g, g + 3*n_polys_k2, grad);
+}
+
+// Laplacians of scaled monomials times h^2
+const double monomLaplacian2[n_polys_f2] = {0, 0, 0, 2, 0, 2};
+const double monomLaplacian3[n_polys_k2] = {0, 0, 0, 0, 2, 0, 0, 2, 0, 2};
+
+// 6-point quadrature on a triangle, exact for degree 4:
+// barycentric coordinates and weights (sum to one)
+const double triQuadL[6][3] = {
+    {0.445948490915965, 0.445948490915965, 0.108103018168070},
+    {0.445948490915965, 0.108103018168070, 0.445948490915965},
+    {0.108103018168070, 0.445948490915965, 0.445948490915965},
+    {0.091576213509771, 0.091576213509771, 0.816847572980459},
+    {0.091576213509771, 0.816847572980459, 0.091576213509771},
+    {0.816847572980459, 0.091576213509771, 0.091576213509771}};
+const double triQuadW[6] = {0.223381589678011, 0.223381589678011, 0.223381589678011,
+			    0.109951743655322, 0.109951743655322, 0.109951743655322};
+
+// 4-point quadrature on a tetrahedron, exact for degree 2
+const double tetQuadA = 0.5854101966249685, tetQuadB = 0.1381966011250105;
+
+// Projector Pi^nabla of the order 2 virtual element space on a polygon
+// with n vertices given in cyclic order by coordinates (u[2*i], u[2*i+1]).
+// Local DOFs are vertex values, values at midpoints of edges (i,i+1)
+// and the polygon average, 2n+1 in total.
+// Fills D ((2n+1) x 6), B and Proj (6 x (2n+1)) and G = B*D (6 x 6),
+// returns area, centroid and diameter used to scale the monomials.
+bool polygonProjectorK2(const double *u, int n,
+			double *D, double *B, double *G, double *Proj,
+			double &area, double *uc, double &h)
+{
+    const int np = n_polys_f2, nd = 2*n+1;
+
+    // Signed area and centroid
+    double sa = 0.0;
+    uc[0] = uc[1] = 0.0;
+    for(int i = 0; i < n; ++i)
+    {
+	    int j = (i+1) % n;
+	    double cr = u[2*i]*u[2*j+1] - u[2*j]*u[2*i+1];
+	    sa    += cr;
+	    uc[0] += (u[2*i]   + u[2*j])   * cr;
+	    uc[1] += (u[2*i+1] + u[2*j+1]) * cr;
+    }
+    sa *= 0.5;
+    uc[0] /= 6.0*sa;
+    uc[1] /= 6.0*sa;
+    double orient = sa > 0.0 ? 1.0 : -1.0;
+    area = fabs(sa);
+
+    h = 0.0;
+    for(int i = 0; i < n; ++i)
+	    for(int j = i+1; j < n; ++j)
+		    h = std::max(h, (u[2*i]-u[2*j])*(u[2*i]-u[2*j]) + (u[2*i+1]-u[2*j+1])*(u[2*i+1]-u[2*j+1]));
+    h = sqrt(h);
+
+    // D: monomials at vertices, edge midpoints and their averages.
+    // Averages are integrated over triangles (uc, u_i, u_{i+1})
+    // with the edge midpoint rule, exact for quadratics
+    double val[n_polys_f2], grad[2*n_polys_f2];
+    double *Davg = D + 2*n*np;
+    std::fill(Davg, Davg + np, 0.0);
+    for(int i = 0; i < n; ++i)
+    {
+	    int j = (i+1) % n;
+	    double mid[2] = {0.5*(u[2*i]+u[2*j]), 0.5*(u[2*i+1]+u[2*j+1])};
+	    scaledMonomials2(u + 2*i, uc, h, D + i*np, NULL);
+	    scaledMonomials2(mid, uc, h, D + (n+i)*np, NULL);
+
+	    double st = 0.5 * orient * ((u[2*i]-uc[0])*(u[2*j+1]-uc[1]) - (u[2*j]-uc[0])*(u[2*i+1]-uc[1]));
+	    double q[3][2] = {{0.5*(uc[0]+u[2*i]), 0.5*(uc[1]+u[2*i+1])},
+			      {mid[0], mid[1]},
+			      {0.5*(uc[0]+u[2*j]), 0.5*(uc[1]+u[2*j+1])}};
+	    for(int k = 0; k < 3; ++k)
+	    {
+		    scaledMonomials2(q[k], uc, h, val, NULL);
+		    for(int a = 0; a < np; ++a)
+			    Davg[a] += st/3.0 * val[a];
+	    }
+    }
+    for(int a = 0; a < np; ++a)
+	    Davg[a] /= area;
+
+    // B(0,:) = P0 is the average DOF,
+    // B(a,:) = int_dE grad m_a * n phi - int_E lap m_a phi otherwise.
+    // Boundary integrals use 3-point Gauss-Lobatto rule on each edge
+    std::fill(B, B + np*nd, 0.0);
+    B[nd-1] = 1.0;
+    for(int i = 0; i < n; ++i)
+    {
+	    int j = (i+1) % n;
+	    double d[2] = {u[2*j]-u[2*i], u[2*j+1]-u[2*i+1]};
+	    double L = sqrt(d[0]*d[0] + d[1]*d[1]);
+	    double nor[2] = {orient*d[1]/L, -orient*d[0]/L};
+	    double mid[2] = {0.5*(u[2*i]+u[2*j]), 0.5*(u[2*i+1]+u[2*j+1])};
+	    const double *pts[3] = {u + 2*i, mid, u + 2*j};
+	    int ids[3] = {i, n+i, j};
+	    double wts[3] = {L/6.0, 4.0*L/6.0, L/6.0};
+	    for(int k = 0; k < 3; ++k)
+	    {
+		    scaledMonomials2(pts[k], uc, h, val, grad);
+		    for(int a = 1; a < np; ++a)
+			    B[a*nd+ids[k]] += wts[k] * (grad[2*a]*nor[0] + grad[2*a+1]*nor[1]);
+	    }
+    }
+    for(int a = 1; a < np; ++a)
+	    B[a*nd+nd-1] -= monomLaplacian2[a] / (h*h) * area;
+
+    // G = B*D, Proj = G^(-1) * B
+    double Ginv[n_polys_f2*n_polys_f2];
+    for(int a = 0; a < np; ++a)
+	    for(int c = 0; c < np; ++c)
+	    {
+		    G[a*np+c] = 0.0;
+		    for(int i = 0; i < nd; ++i)
+			    G[a*np+c] += B[a*nd+i] * D[i*np+c];
+		    Ginv[a*np+c] = G[a*np+c];
+	    }
+    if(!invertSmallMatrix(Ginv, np))
+	    return false;
+    for(int a = 0; a < np; ++a)
+	    for(int i = 0; i < nd; ++i)
+	    {
+		    Proj[a*nd+i] = 0.0;
+		    for(int c = 0; c < np; ++c)
+			    Proj[a*nd+i] += Ginv[a*np+c] * B[c*nd+i];
+	    }
+    return true;
+}
+
+// Average of a function over a polygonal face,
+// integrated over triangles (face centroid, x_i, x_{i+1})
+double faceAverage(const Face &f, double (*func)(double *))
+{
+    ElementArray<Node> fnodes = f.getNodes();
+    int nfn = fnodes.size();
+    double xf[3], area = 0.0, res = 0.0;
+    f.Centroid(xf);
+    for(int k = 0; k < nfn; ++k)
+    {
+	    Storage::real_array x1 = fnodes[k].Coords(), x2 = fnodes[(k+1)%nfn].Coords();
+	    double a[3] = {x1[0]-xf[0], x1[1]-xf[1], x1[2]-xf[2]};
+	    double b[3] = {x2[0]-xf[0], x2[1]-xf[1], x2[2]-xf[2]};
+	    double cr[3] = {a[1]*b[2]-a[2]*b[1], a[2]*b[0]-a[0]*b[2], a[0]*b[1]-a[1]*b[0]};
+	    double tarea = 0.5 * sqrt(cr[0]*cr[0] + cr[1]*cr[1] + cr[2]*cr[2]);
+	    for(int q = 0; q < 6; ++q)
+	    {
+		    double x[3];
+		    for(int d = 0; d < 3; ++d)
+			    x[d] = triQuadL[q][0]*xf[d] + triQuadL[q][1]*x1[d] + triQuadL[q][2]*x2[d];
+		    res += triQuadW[q] * tarea * func(x);
+	    }
+	    area += tarea;
+    }
+    return res / area;
+}
+
+// Average of a function over a polyhedral cell,
+// integrated over tetrahedra (cell centroid, face centroid, x_i, x_{i+1})
+// as in assembleLocalSystemK2
+double cellAverage(const Cell &c, double (*func)(double *))
+{
+    ElementArray<Face> faces = c.getFaces();
+    double xc[3], vol = 0.0, res = 0.0;
+    c.Centroid(xc);
+    for(int fid = 0; fid < (int)faces.size(); ++fid)
+    {
+	    ElementArray<Node> fnodes = faces[fid].getNodes();
+	    int nfn = fnodes.size();
+	    double xf[3];
+	    faces[fid].Centroid(xf);
+	    for(int k = 0; k < nfn; ++k)
+	    {
+		    Storage::real_array x1 = fnodes[k].Coords(), x2 = fnodes[(k+1)%nfn].Coords();
+		    double e0[3] = {xf[0]-xc[0], xf[1]-xc[1], xf[2]-xc[2]};
+		    double e1[3] = {x1[0]-xc[0], x1[1]-xc[1], x1[2]-xc[2]};
+		    double e2[3] = {x2[0]-xc[0], x2[1]-xc[1], x2[2]-xc[2]};
+		    double tvol = fabs(e0[0]*(e1[1]*e2[2]-e1[2]*e2[1])
+				      - e0[1]*(e1[0]*e2[2]-e1[2]*e2[0])
+				      + e0[2]*(e1[0]*e2[1]-e1[1]*e2[0])) / 6.0;
+		    for(int q = 0; q < 4; ++q)
+		    {
+			    double x[3];
+			    for(int d = 0; d < 3; ++d)
+				    x[d] = tetQuadB*(xc[d] + xf[d] + x1[d] + x2[d]) + (tetQuadA - tetQuadB) *
+					    (q == 0 ? xc[d] : q == 1 ? xf[d] : q == 2 ? x1[d] : x2[d]);
+			    res += 0.25 * tvol * func(x);
+		    }
+		    vol += tvol;
+	    }
+    }
+    return res / vol;
+}
+
+// Workspace of the 3D kernels, see VemWorkspace
+class LocalWorkspace : public VemWorkspace
+{
+private:
+    std::vector<HandleType> hbuf;
+    std::vector<int> ibuf;
+public:
+    HandleType *cnodes;  // nn, handles of cell nodes, replace node->local index map
+    // Order 2 only
+    int *eloc;           // ne x 2, local node indices of cell edges
+    int *fmap;           // 2*nn+1, face DOF -> cell DOF map
+    double *fu;          // 2 x nn, face node coordinates in the face plane
+    double *FD;          // (2*nn+1) x 6, face matrices
+    double *FB;          // 6 x (2*nn+1)
+    double *FProj;       // 6 x (2*nn+1)
+
+    LocalWorkspace() : cnodes(NULL), eloc(NULL), fmap(NULL),
+	    fu(NULL), FD(NULL), FB(NULL), FProj(NULL) {}
+    // nn - max number of nodes, nd - max number of DOFs per cell,
+    // np - number of monomials
+    void init(int nn, int nd, int np)
+    {
+	    int nfd = 2*nn+1;
+	    hbuf.assign(nn, InvalidHandle());
+	    ibuf.assign(2*nd + nfd, -1);
+	    cnodes = hbuf.data();
+	    eloc = ibuf.data();
+	    fmap = eloc + 2*nd;
+	    fu   = initCommon(nd, np, 2*nn + 3*n_polys_f2*nfd);
+	    FD   = fu   + 2*nn;
+	    FB   = FD   + n_polys_f2*nfd;
+	    FProj= FB   + n_polys_f2*nfd;
+    }
+    // Position of node in cnodes, linear search is cheap for cell-sized arrays
+    int find(HandleType h, int nn) const
+    {
+	    for(int i = 0; i < nn; ++i)
+		    if(cnodes[i] == h)
+			    return i;
+	    return -1;
+    }
+    // Position of edge (a,b) in eloc
+    int findEdge(int a, int c, int ne) const
+    {
+	    for(int e = 0; e < ne; ++e)
+		    if((eloc[2*e] == a && eloc[2*e+1] == c) || (eloc[2*e] == c && eloc[2*e+1] == a))
+			    return e;
+	    return -1;
+    }
+};
+
 class Problem
 {
 private:
@@ -84,8 +389,17 @@ private:
     Tag tagBC;    // Boundary conditions
     Tag tagSol;   // Solution
     Tag tagSolEx; // Exact solution
+    // Cached per-cell VEM quantities, independent of the diffusion tensor
+    Tag tagVemGeom; // Cell diameter and centroid
+    Tag tagVemG;    // G = B*D with unscaled gradients and zero first row
+    Tag tagVemProj; // Projector (B*D)^(-1) * B
+    Tag tagVemStab; // Stabilization Se^T * Se
+
+    MarkerType mrkDirNode;  // Dirichlet DOF marker
+    MarkerType mrkIface;    // Cells reading the exchanged tensor, assembled after halo exchange
 
-    MarkerType mrkDirNode;  // Dirichlet node marker
+    int order;              // VEM order, 1 or 2
+    ElementType dofTypes;   // Elements carrying DOFs
 
     Automatizator aut;    // Automatizator to handle all AD things
     Residual R;           // Residual to assemble
@@ -95,22 +409,36 @@ private:
 
     int numDirNodes;
 
+    LocalWorkspace work;  // Storage for local matrices
+    ElementArray<Element> dofs; // Local DOFs of the current cell, reused between cells
+    bool vemCached;       // VEM cache tags are filled, tensor and geometry are fixed for a run
+    bool haloReady;       // Diffusion tensor is exchanged to ghost cells
+    bool restarted;       // Solution is loaded from a checkpoint
+
     double times[10];
     double ttt; // global timer
 
 public:
-    Problem(std::string meshName);
+    Problem(std::string meshName, int vemOrder = 1);
     ~Problem();
-    void initProblem(); // create tags and set parameters
+    void initProblem(bool restart = false); // create tags and set parameters, restart keeps loaded solution
     void assembleGlobalSystem(); // assemble global linear system
-    void assembleLocalSystem(Cell &, rMatrix &, rMatrix &);
+    void assembleCell(Cell &); // add contribution of one cell to residual
+    void buildLocalProjector(Cell &, const ElementArray<Node> &); // fills VEM cache tags
+    void assembleLocalSystem(Cell &, const ElementArray<Node> &); // fills work.W, work.b
+    void assembleLocalSystemK2(Cell &, const ElementArray<Element> &, int, int, int); // same for order 2
     void solveSystem();
     void saveSolution(std::string path); // save mesh with solution
+    void saveWithout(std::string path, const Tag *skip, int nskip); // save mesh without given tags
+    void saveCheckpoint(std::string prefix); // save solution tags only in binary parallel format, call last
 };
 
-Problem::Problem(std::string meshName)
+Problem::Problem(std::string meshName, int vemOrder)
 {
     ttt = Timer();
+    order = vemOrder;
+    // Order 2 adds edge midpoint values, face and cell averages to vertex values
+    dofTypes = (order == 2) ? (NODE|EDGE|FACE|CELL) : NODE;
     for(int i = 0; i < 10; i++)
         times[i] = 0.;
 
@@ -119,8 +447,16 @@ Problem::Problem(std::string meshName)
 
     double t = Timer();
 
+    // Parallel files (see partition_mesh) are already partitioned,
+    // every rank loads its own part. They are repartitioned only
+    // if they were written for another number of processes
+    bool partitioned = false;
     if(m.isParallelFileFormat(meshName))
+    {
 	    m.Load(meshName);
+	    int nonEmpty = m.Integrate(m.NumberOfCells() > 0 ? 1 : 0);
+	    partitioned = (nonEmpty == m.GetProcessorsNumber());
+    }
     else if(rank == 0)
     {
         m.Load(meshName);
@@ -132,10 +468,13 @@ Problem::Problem(std::string meshName)
 
     if(m.GetProcessorsNumber() > 1)
     {
-	Partitioner part(&m);
-	part.SetMethod(Partitioner::INNER_KMEANS, Partitioner::Partition);
-	part.Evaluate();
-	m.Redistribute();
+	if(!partitioned)
+	{
+		Partitioner part(&m);
+		part.SetMethod(Partitioner::INNER_KMEANS, Partitioner::Partition);
+		part.Evaluate();
+		m.Redistribute();
+	}
 	m.AssignGlobalID(NODE);
 	m.ExchangeGhost(1, NODE);
     }
@@ -173,38 +512,93 @@ Problem::~Problem()
 	}
 }
 
-void Problem::initProblem()
+void Problem::initProblem(bool restart)
 {
     double t = Timer();
+    // A checkpoint written by saveCheckpoint carries the solution,
+    // on restart it is used as the initial guess.
+    // Otherwise a SOLUTION tag present in the mesh file is overwritten
+    restarted = restart;
+    if(restarted && !m.HaveTag(tagNameSol))
+    {
+	    if(rank == 0) std::cout << "Restart requested, but mesh has no " << tagNameSol << " tag" << std::endl;
+	    exit(1);
+    }
+    if(restarted && rank == 0) std::cout << "Restart from loaded solution" << std::endl;
     tagD     = m.CreateTag(tagNameTensor, DATA_REAL, CELL, NONE, 6);
-    tagBC    = m.CreateTag(tagNameBC,     DATA_REAL, NODE, NODE, 1);
-    tagSol   = m.CreateTag(tagNameSol,    DATA_REAL, NODE, NONE, 1);
-    tagSolEx = m.CreateTag(tagNameSolEx,  DATA_REAL, NODE, NONE, 1);
+    tagBC    = m.CreateTag(tagNameBC,     DATA_REAL, dofTypes & ~CELL, dofTypes & ~CELL, 1);
+    tagSol   = m.CreateTag(tagNameSol,    DATA_REAL, dofTypes, NONE, 1);
+    tagSolEx = m.CreateTag(tagNameSolEx,  DATA_REAL, dofTypes, NONE, 1);
+    tagVemGeom = m.CreateTag(tagNameVemGeom, DATA_REAL, CELL, NONE, 4);
+    tagVemG    = m.CreateTag(tagNameVemG,    DATA_REAL, CELL, NONE, n_polys*n_polys);
+    tagVemProj = m.CreateTag(tagNameVemProj, DATA_REAL, CELL, NONE);
+    tagVemStab = m.CreateTag(tagNameVemStab, DATA_REAL, CELL, NONE);
+    vemCached = false;
+    haloReady = false;
 
-    // Set diffusion tensor
+    // Set diffusion tensor, ghost values are exchanged during the first assembly.
+    // Only ghost cells read the exchanged tensor: an owned cell uses its own
+    // tensor, and boundary data and solution values of its ghost DOFs are
+    // set locally or exchanged in solveSystem. So only ghost cells wait
     double D[6] = {Dxx,Dyy,Dzz,Dxy,Dxz,Dyz};
-    for(Mesh::iteratorCell icell = m.BeginCell(); icell != m.EndCell(); icell++) if(icell->GetStatus() != Element::Ghost)
+    mrkIface = m.CreateMarker();
+    for(Mesh::iteratorCell icell = m.BeginCell(); icell != m.EndCell(); icell++)
     {
+	    if(icell->GetStatus() == Element::Ghost)
+	    {
+		    icell->SetMarker(mrkIface);
+		    continue;
+	    }
 	    for(int k = 0; k < 6; ++k)
 		    icell->RealArray(tagD)[k] = D[k];
     }
-    m.ExchangeData(tagD, CELL);
+
+    // Size local workspace by the largest cell, ghost cells are assembled too
+    int maxnn = 0, maxne = 0, maxnf = 0;
+    for(Mesh::iteratorCell icell = m.BeginCell(); icell != m.EndCell(); icell++)
+    {
+	    maxnn = std::max(maxnn, static_cast<int>(icell->nbAdjElements(NODE)));
+	    maxne = std::max(maxne, static_cast<int>(icell->nbAdjElements(EDGE)));
+	    maxnf = std::max(maxnf, static_cast<int>(icell->nbAdjElements(FACE)));
+    }
+    if(order == 2)
+	    work.init(maxnn, maxnn + maxne + maxnf + 1, n_polys_k2);
+    else
+	    work.init(maxnn, maxnn, n_polys);
+    dofs = ElementArray<Element>(&m);
+    dofs.reserve(work.maxnd);
 
     // Set boundary conditions
-    // Mark and count Dirichlet nodes
+    // Mark and count Dirichlet DOFs: nodes, and for order 2 also
+    // edges and faces lying on the boundary
     // Compute RHS and exact solution
     mrkDirNode = m.CreateMarker();
     m.MarkBoundaryFaces(mrkDirNode);
     numDirNodes = 0;
-    for(Mesh::iteratorNode inode = m.BeginNode(); inode != m.EndNode(); inode++) //if(inode->GetStatus() != Element::Ghost)
+    for(Mesh::iteratorElement inode = m.BeginElement(dofTypes); inode != m.EndElement(); inode++) //if(inode->GetStatus() != Element::Ghost)
     {
-        Node node = inode->getAsNode();
+        Element node = inode->self();
         double x[3];
         node.Barycenter(x);
-        node.Real(tagSolEx) = exactSolution(x);
-        node.Real(tagSol) = 0.0;
+        // The cell DOF is the cell average
+        if(node.GetElementType() == CELL)
+	        node.Real(tagSolEx) = cellAverage(node.getAsCell(), exactSolution);
+        else
+	        node.Real(tagSolEx) = exactSolution(x);
+        if(!restarted)
+            node.Real(tagSol) = 0.0;
 
-	if(node.nbAdjElements(FACE, mrkDirNode))
+	if(node.GetElementType() == FACE)
+	{
+		// Boundary faces are marked already, their DOF is the face average
+		node.Real(tagSolEx) = faceAverage(node.getAsFace(), exactSolution);
+		if(node.GetMarker(mrkDirNode))
+		{
+			numDirNodes++;
+			node.Real(tagBC) = node.Real(tagSolEx);
+		}
+	}
+	else if(node.GetElementType() != CELL && node.nbAdjElements(FACE, mrkDirNode))
 	{
 		node.SetMarker(mrkDirNode);
 		numDirNodes++;
@@ -212,11 +606,11 @@ void Problem::initProblem()
 	}
     }
     numDirNodes = m.Integrate(numDirNodes);
-    if(rank == 0) std::cout << "Number of Dirichlet nodes: " << numDirNodes << std::endl;
+    if(rank == 0) std::cout << "Number of Dirichlet DOFs: " << numDirNodes << std::endl;
 
     Automatizator::MakeCurrent(&aut);
 
-    INMOST_DATA_ENUM_TYPE SolTagEntryIndex = aut.RegisterTag(tagSol, NODE, mrkDirNode, true);
+    INMOST_DATA_ENUM_TYPE SolTagEntryIndex = aut.RegisterTag(tagSol, dofTypes, mrkDirNode, true);
     var = dynamic_variable(aut, SolTagEntryIndex);
     aut.EnumerateEntries();
     R = Residual("vem_diffusion", aut.GetFirstIndex(), aut.GetLastIndex());
@@ -226,115 +620,484 @@ void Problem::initProblem()
 void Problem::assembleGlobalSystem()
 {
     double t = Timer();
-    for(Mesh::iteratorCell icell = m.BeginCell(); icell != m.EndCell(); ++icell) //if(icell->GetStatus() != Element::Ghost)
+    R.Clear();
+    // Owned cells need only local data, so they are assembled
+    // while the diffusion tensor travels to ghost cells
+    Mesh::exchange_data halo;
+    if(!haloReady)
+	    m.ExchangeDataBegin(tagD, CELL, 0, halo);
+    for(Mesh::iteratorCell icell = m.BeginCell(); icell != m.EndCell(); ++icell) if(!icell->GetMarker(mrkIface))
     {
         Cell cell = icell->getAsCell();
+        assembleCell(cell);
+    }
+    if(!haloReady)
+    {
+	    m.ExchangeDataEnd(tagD, CELL, 0, halo);
+	    haloReady = true;
+    }
+    for(Mesh::iteratorCell icell = m.BeginCell(); icell != m.EndCell(); ++icell) if(icell->GetMarker(mrkIface))
+    {
+        Cell cell = icell->getAsCell();
+        assembleCell(cell);
+    }
+    vemCached = true;
+    times[T_ASSEMBLE] += Timer() - t;
+}
 
-        ElementArray<Node> nodes = icell->getNodes();
-        rMatrix rhs, W;
-        assembleLocalSystem(cell, W, rhs);
-
-        int nnodes = nodes.size();
+void Problem::assembleCell(Cell &cell)
+{
+    // Local DOFs: nodes, then for order 2 edges, faces and the cell.
+    // The DOF list reuses dofs, but the adjacency queries below
+    // (and the per-face node lists in the local kernels) still
+    // return fresh arrays from INMOST for every cell
+    ElementArray<Element> &nodes = dofs;
+    nodes.clear();
+    ElementArray<Node> cnodes = cell.getNodes();
+    for(int k = 0; k < (int)cnodes.size(); ++k)
+        nodes.push_back(cnodes[k]);
+    if(order == 2)
+    {
+        ElementArray<Edge> edges = cell.getEdges();
+        ElementArray<Face> faces = cell.getFaces();
+        for(int k = 0; k < (int)edges.size(); ++k)
+            nodes.push_back(edges[k]);
+        for(int k = 0; k < (int)faces.size(); ++k)
+            nodes.push_back(faces[k]);
+        nodes.push_back(cell);
+        assembleLocalSystemK2(cell, nodes, cnodes.size(), edges.size(), faces.size());
+    }
+    else
+    {
+        if(!vemCached)
+            buildLocalProjector(cell, cnodes);
+        assembleLocalSystem(cell, cnodes);
+    }
+    int nnodes = nodes.size();
+    raMatrix W   = raMatrixMake(work.W, nnodes, nnodes);
+    raMatrix rhs = raMatrixMake(work.b, nnodes, 1);
 
-        for(int i = 0; i != nnodes; i++)
-	{
-            if(nodes[i]->GetMarker(mrkDirNode)) // boundary node
-	    {
-                double bcVal = nodes[i].Real(tagBC);
-                for(int j = 0; j != nnodes; j++)
-                    if(nodes[j].GetStatus() != Element::Ghost && !nodes[j].GetMarker(mrkDirNode))
-                        R[var.Index(nodes[j])] += bcVal * W(j,i);
-            }
-            else if(nodes[i].GetStatus() != Element::Ghost) // Node with unknown
-	    {
-                for(int j = 0; j != nnodes; j++)
-                    if(!nodes[j].GetMarker(mrkDirNode))
-                        R[var.Index(nodes[i])] += W(j,i) * var(nodes[j]);
-                R[var.Index(nodes[i])] -= rhs(i,0);
-            }
+    for(int i = 0; i != nnodes; i++)
+    {
+        if(nodes[i].GetMarker(mrkDirNode)) // boundary node
+        {
+            double bcVal = nodes[i].Real(tagBC);
+            for(int j = 0; j != nnodes; j++)
+                if(nodes[j].GetStatus() != Element::Ghost && !nodes[j].GetMarker(mrkDirNode))
+                    R[var.Index(nodes[j])] += bcVal * W(j,i);
+        }
+        else if(nodes[i].GetStatus() != Element::Ghost) // Node with unknown
+        {
+            for(int j = 0; j != nnodes; j++)
+                if(!nodes[j].GetMarker(mrkDirNode))
+                    R[var.Index(nodes[i])] += W(j,i) * var(nodes[j]);
+            R[var.Index(nodes[i])] -= rhs(i,0);
         }
     }
-    times[T_ASSEMBLE] += Timer() - t;
 }
 
 
-void Problem::assembleLocalSystem(Cell &cell, rMatrix &W, rMatrix &b)
+// Computes the part of the local VEM system which depends only on geometry.
+// For the lowest order space the diffusion tensor K scales rows 1..3 of
+// both B and G, so it cancels in the projector (B*D)^(-1) * B
+// and only enters the consistency term, see assembleLocalSystem.
+void Problem::buildLocalProjector(Cell &cell, const ElementArray<Node> &nodes)
 {
-    ElementArray<Node> nodes = cell.getNodes();
     ElementArray<Face> faces = cell.getFaces();
     int nn = nodes.size(), nf = faces.size();
+    double *D = work.D, *B = work.B, *Proj = work.Proj, *Se = work.Se;
     double xc[3], diam = 0.0;
     cell.Centroid(xc);
-    for(ElementArray<Node>::iterator it = nodes.begin(); it != nodes.end(); it++)
+    for(int i = 0; i < nn; ++i)
     {
-	    Storage::real_array xi = it->Coords();
-	    for(auto jt = nodes.begin(); jt != nodes.end(); jt++)
+	    Storage::real_array xi = nodes[i].Coords();
+	    for(int j = i+1; j < nn; ++j)
 	    {
-		    Storage::real_array xj = jt->Coords();
+		    Storage::real_array xj = nodes[j].Coords();
 		    diam = std::max(diam, (xi[0]-xj[0])*(xi[0]-xj[0]) + (xi[1]-xj[1])*(xi[1]-xj[1]) + (xi[2]-xj[2])*(xi[2]-xj[2]));
 	    }
     }
     diam = sqrt(diam);
-    rMatrix D(nn, n_polys), B(n_polys, nn);
-    B.Zero();
-    D.Zero();
+    std::fill(B, B + n_polys*nn, 0.0);
     for(int i = 0; i < nn; i++)
     {
-	    D(i,0) = 1.0;
-	    B(0,i) = 1.0/nn;
+	    D[i*n_polys] = 1.0;
+	    B[i] = 1.0/nn;
+	    work.cnodes[i] = nodes[i].GetHandle();
     }
 
-    std::map<HandleType,int> gid_cnodes;
-    for(int i = 0; i < nn; ++i) gid_cnodes[nodes[i].GlobalID()] = i;
-
-    Storage::real_array K = cell.RealArray(tagD);
     for(int fid = 0; fid < nf; ++fid)
     {
 	    Face f = faces[fid];
 	    double area = f.Area();
-	    double nrm[3], knrm[3];
+	    double nrm[3];
 	    f.OrientedUnitNormal(cell, nrm);
-	    knrm[0] = K[0]*nrm[0] + K[3]*nrm[1] + K[4]*nrm[2];
-	    knrm[1] = K[3]*nrm[0] + K[1]*nrm[1] + K[5]*nrm[2];
-	    knrm[2] = K[4]*nrm[0] + K[5]*nrm[1] + K[2]*nrm[2];
 	    ElementArray<Node> fnodes = f.getNodes();
 	    int nfn = fnodes.size();
 	    for(int k = 0; k < nfn; ++k) 
 	    {
-		    Node node = fnodes[k];
-		    assert(gid_cnodes.find(node.GlobalID()) != gid_cnodes.end());
-		    int i = gid_cnodes[node.GlobalID()];
-		    assert(i < nn);
+		    int i = work.find(fnodes[k].GetHandle(), nn);
+		    assert(i >= 0 && i < nn);
 		    for(int j = 1; j < n_polys; ++j)
-			    B(j,i) += 1.0/nfn * area / diam * knrm[j-1];
+			    B[j*nn+i] += 1.0/nfn * area / diam * nrm[j-1];
 	    }
     }
     for(int vid = 0; vid < nn; ++vid)
     {
 	    Storage::real_array xv = nodes[vid].Coords();
-	    double monom[3] = { (xv[0]-xc[0])/diam, (xv[1]-xc[1])/diam, (xv[2]-xc[2])/diam };
 	    for(int j = 1; j < n_polys; ++j)
-		    D(vid,j) = monom[j-1];
+		    D[vid*n_polys+j] = (xv[j-1]-xc[j-1])/diam;
     }
-    int ierr = -1;
-    rMatrix BDinv = (B*D).Invert(&ierr);
-    if(ierr > 0) 
+
+    // G = B*D, Proj = G^(-1) * B
+    double G[n_polys*n_polys], Ginv[n_polys*n_polys];
+    for(int a = 0; a < n_polys; ++a)
+	    for(int c = 0; c < n_polys; ++c)
+	    {
+		    G[a*n_polys+c] = 0.0;
+		    for(int i = 0; i < nn; ++i)
+			    G[a*n_polys+c] += B[a*nn+i] * D[i*n_polys+c];
+		    Ginv[a*n_polys+c] = G[a*n_polys+c];
+	    }
+    if(!invertSmallMatrix(Ginv, n_polys))
     {
-	    std::cerr << "ierr = " << ierr << std::endl;
+	    std::cerr << "Singular B*D in cell " << cell.GlobalID() << std::endl;
 	    std::cerr << "B" << std::endl;
-	    B.Print();
+	    raMatrixMake(B, n_polys, nn).Print();
 	    std::cerr << "D" << std::endl;
-	    D.Print();
+	    raMatrixMake(D, nn, n_polys).Print();
 	    std::cerr << "B*D" << std::endl;
-	    (B*D).Print();
+	    raMatrixMake(G, n_polys, n_polys).Print();
+	    exit(1);
     }
-    rMatrix Proj = BDinv * B;
-    rMatrix Se = rMatrix::Unit(nn) - D*Proj;
-    rMatrix G = B*D;
-    G(0,1,0,n_polys).Zero();
-    W = Proj.Transpose() * G * Proj + Se.Transpose() * Se;
+    for(int a = 0; a < n_polys; ++a)
+	    for(int i = 0; i < nn; ++i)
+	    {
+		    Proj[a*nn+i] = 0.0;
+		    for(int c = 0; c < n_polys; ++c)
+			    Proj[a*nn+i] += Ginv[a*n_polys+c] * B[c*nn+i];
+	    }
+
+    // Se = I - D*Proj
+    for(int i = 0; i < nn; ++i)
+	    for(int j = 0; j < nn; ++j)
+	    {
+		    double dp = 0.0;
+		    for(int a = 0; a < n_polys; ++a)
+			    dp += D[i*n_polys+a] * Proj[a*nn+j];
+		    Se[i*nn+j] = (i == j ? 1.0 : 0.0) - dp;
+	    }
+
+    // Store everything in the cache tags
+    Storage::real_array geom = cell.RealArray(tagVemGeom);
+    geom[0] = diam;
+    for(int k = 0; k < 3; ++k)
+	    geom[k+1] = xc[k];
+
+    Storage::real_array cG = cell.RealArray(tagVemG);
+    std::fill(cG.begin(), cG.begin() + n_polys, 0.0);
+    std::copy(G + n_polys, G + n_polys*n_polys, cG.begin() + n_polys);
+
+    Storage::real_array cProj = cell.RealArray(tagVemProj);
+    cProj.resize(n_polys*nn);
+    std::copy(Proj, Proj + n_polys*nn, cProj.begin());
+
+    Storage::real_array cStab = cell.RealArray(tagVemStab);
+    cStab.resize(nn*nn);
+    for(int i = 0; i < nn; ++i)
+	    for(int j = 0; j < nn; ++j)
+	    {
+		    double w = 0.0;
+		    for(int k = 0; k < nn; ++k)
+			    w += Se[k*nn+i] * Se[k*nn+j];
+		    cStab[i*nn+j] = w;
+	    }
+}
+
+// Combines cached VEM quantities with the diffusion tensor:
+// W = Proj^T * diag(1,K) * G * Proj + Se^T * Se
+void Problem::assembleLocalSystem(Cell &cell, const ElementArray<Node> &nodes)
+{
+    int nn = nodes.size();
+    double *GP = work.GP, *W = work.W, *b = work.b;
+    Storage::real_array geom  = cell.RealArray(tagVemGeom);
+    Storage::real_array cG    = cell.RealArray(tagVemG);
+    Storage::real_array cProj = cell.RealArray(tagVemProj);
+    Storage::real_array cStab = cell.RealArray(tagVemStab);
+    Storage::real_array K = cell.RealArray(tagD);
+    double Kfull[3][3] = {{K[0], K[3], K[4]}, {K[3], K[1], K[5]}, {K[4], K[5], K[2]}};
+
+    // KG = diag(1,K) * G, first row of G is zero
+    double KG[n_polys*n_polys];
+    std::fill(KG, KG + n_polys, 0.0);
+    for(int a = 1; a < n_polys; ++a)
+	    for(int c = 0; c < n_polys; ++c)
+	    {
+		    KG[a*n_polys+c] = 0.0;
+		    for(int l = 1; l < n_polys; ++l)
+			    KG[a*n_polys+c] += Kfull[a-1][l-1] * cG[l*n_polys+c];
+	    }
+
+    for(int a = 0; a < n_polys; ++a)
+	    for(int j = 0; j < nn; ++j)
+	    {
+		    GP[a*nn+j] = 0.0;
+		    for(int c = 0; c < n_polys; ++c)
+			    GP[a*nn+j] += KG[a*n_polys+c] * cProj[c*nn+j];
+	    }
+
+    for(int i = 0; i < nn; ++i)
+	    for(int j = 0; j < nn; ++j)
+	    {
+		    double w = cStab[i*nn+j];
+		    for(int a = 0; a < n_polys; ++a)
+			    w += cProj[a*nn+i] * GP[a*nn+j];
+		    W[i*nn+j] = w;
+	    }
+
+    double xc[3] = {geom[1], geom[2], geom[3]};
     double rhs = exactSolutionRHS(xc) * cell.Volume() / nn;
-    b = rMatrix::Col(nn, rhs);
+    std::fill(b, b + nn, rhs);
+}
+
+// Order 2 local system. Uses Pi^nabla projector built with plain gradients,
+// the diffusion tensor enters the consistency term int_E K grad m_a * grad m_b.
+// Boundary integrals over faces use the face projector of the enhanced space:
+// int_F (grad m_a * n) phi = int_F (grad m_a * n) Pi_F phi.
+void Problem::assembleLocalSystemK2(Cell &cell, const ElementArray<Element> &dofs, int nn, int ne, int nf)
+{
+    const int np = n_polys_k2, npf = n_polys_f2;
+    int nd = nn + ne + nf + 1;
+    double *D = work.D, *B = work.B, *Proj = work.Proj, *GP = work.GP;
+    double *Se = work.Se, *W = work.W, *b = work.b;
+    double val[n_polys_k2], grad[3*n_polys_k2], valf[n_polys_f2];
+
+    for(int i = 0; i < nn; ++i)
+	    work.cnodes[i] = dofs[i].GetHandle();
+    for(int e = 0; e < ne; ++e)
+    {
+	    Edge ed = dofs[nn+e].getAsEdge();
+	    work.eloc[2*e]   = work.find(ed.getBeg().GetHandle(), nn);
+	    work.eloc[2*e+1] = work.find(ed.getEnd().GetHandle(), nn);
+    }
+
+    double xc[3], diam = 0.0;
+    cell.Centroid(xc);
+    for(int i = 0; i < nn; ++i)
+    {
+	    Storage::real_array xi = dofs[i].getAsNode().Coords();
+	    for(int j = i+1; j < nn; ++j)
+	    {
+		    Storage::real_array xj = dofs[j].getAsNode().Coords();
+		    diam = std::max(diam, (xi[0]-xj[0])*(xi[0]-xj[0]) + (xi[1]-xj[1])*(xi[1]-xj[1]) + (xi[2]-xj[2])*(xi[2]-xj[2]));
+	    }
+    }
+    diam = sqrt(diam);
+
+    // D rows for vertices and edge midpoints
+    for(int i = 0; i < nn; ++i)
+    {
+	    Storage::real_array x = dofs[i].getAsNode().Coords();
+	    scaledMonomials3(x.data(), xc, diam, D + i*np, NULL);
+    }
+    for(int e = 0; e < ne; ++e)
+    {
+	    Storage::real_array x1 = dofs[work.eloc[2*e]].getAsNode().Coords();
+	    Storage::real_array x2 = dofs[work.eloc[2*e+1]].getAsNode().Coords();
+	    double mid[3] = {0.5*(x1[0]+x2[0]), 0.5*(x1[1]+x2[1]), 0.5*(x1[2]+x2[2])};
+	    scaledMonomials3(mid, xc, diam, D + (nn+e)*np, NULL);
+    }
+
+    // Face loop: face average rows of D, boundary part of B;
+    // tetrahedra (xc, xf, x_k, x_k+1) give cell average row of D
+    // and consistency matrix GK = int_E K grad m_a * grad m_b
+    Storage::real_array K = cell.RealArray(tagD);
+    double Kfull[3][3] = {{K[0], K[3], K[4]}, {K[3], K[1], K[5]}, {K[4], K[5], K[2]}};
+    double GK[n_polys_k2*n_polys_k2], vol = 0.0;
+    double *Dcell = D + (nd-1)*np;
+    std::fill(GK, GK + np*np, 0.0);
+    std::fill(Dcell, Dcell + np, 0.0);
+    std::fill(B, B + np*nd, 0.0);
+    for(int fid = 0; fid < nf; ++fid)
+    {
+	    Face f = dofs[nn+ne+fid].getAsFace();
+	    ElementArray<Node> fnodes = f.getNodes();
+	    int nfn = fnodes.size(), nfd = 2*nfn+1;
+	    double nrm[3], xf[3], t1[3], t2[3];
+	    f.OrientedUnitNormal(cell, nrm);
+	    f.Centroid(xf);
+
+	    // Orthonormal basis in the face plane
+	    Storage::real_array x0 = fnodes[0].Coords();
+	    for(int d = 0; d < 3; ++d)
+		    t1[d] = x0[d] - xf[d];
+	    double tn = t1[0]*nrm[0] + t1[1]*nrm[1] + t1[2]*nrm[2];
+	    for(int d = 0; d < 3; ++d)
+		    t1[d] -= tn * nrm[d];
+	    tn = sqrt(t1[0]*t1[0] + t1[1]*t1[1] + t1[2]*t1[2]);
+	    for(int d = 0; d < 3; ++d)
+		    t1[d] /= tn;
+	    t2[0] = nrm[1]*t1[2] - nrm[2]*t1[1];
+	    t2[1] = nrm[2]*t1[0] - nrm[0]*t1[2];
+	    t2[2] = nrm[0]*t1[1] - nrm[1]*t1[0];
+
+	    // Face DOFs to cell DOFs
+	    for(int k = 0; k < nfn; ++k)
+	    {
+		    Storage::real_array x = fnodes[k].Coords();
+		    work.fu[2*k]   = (x[0]-xf[0])*t1[0] + (x[1]-xf[1])*t1[1] + (x[2]-xf[2])*t1[2];
+		    work.fu[2*k+1] = (x[0]-xf[0])*t2[0] + (x[1]-xf[1])*t2[1] + (x[2]-xf[2])*t2[2];
+		    work.fmap[k] = work.find(fnodes[k].GetHandle(), nn);
+	    }
+	    for(int k = 0; k < nfn; ++k)
+	    {
+		    int e = work.findEdge(work.fmap[k], work.fmap[(k+1)%nfn], ne);
+		    assert(e >= 0);
+		    work.fmap[nfn+k] = nn + e;
+	    }
+	    work.fmap[2*nfn] = nn + ne + fid;
+
+	    double FG[n_polys_f2*n_polys_f2], farea, fuc[2], fh;
+	    if(!polygonProjectorK2(work.fu, nfn, work.FD, work.FB, FG, work.FProj, farea, fuc, fh))
+	    {
+		    std::cerr << "Singular face projector in cell " << cell.GlobalID() << std::endl;
+		    exit(1);
+	    }
+
+	    // I(a,b) = int_F (grad m_a * n) mF_b
+	    double I[n_polys_k2*n_polys_f2], Dface[n_polys_k2], qarea = 0.0;
+	    std::fill(I, I + np*npf, 0.0);
+	    std::fill(Dface, Dface + np, 0.0);
+	    for(int k = 0; k < nfn; ++k)
+	    {
+		    Storage::real_array x1 = fnodes[k].Coords(), x2 = fnodes[(k+1)%nfn].Coords();
+		    double a[3] = {x1[0]-xf[0], x1[1]-xf[1], x1[2]-xf[2]};
+		    double c[3] = {x2[0]-xf[0], x2[1]-xf[1], x2[2]-xf[2]};
+		    double cr[3] = {a[1]*c[2]-a[2]*c[1], a[2]*c[0]-a[0]*c[2], a[0]*c[1]-a[1]*c[0]};
+		    double tarea = 0.5 * sqrt(cr[0]*cr[0] + cr[1]*cr[1] + cr[2]*cr[2]);
+		    qarea += tarea;
+		    for(int q = 0; q < 6; ++q)
+		    {
+			    double x[3], uq[2];
+			    for(int d = 0; d < 3; ++d)
+				    x[d] = triQuadL[q][0]*xf[d] + triQuadL[q][1]*x1[d] + triQuadL[q][2]*x2[d];
+			    uq[0] = (x[0]-xf[0])*t1[0] + (x[1]-xf[1])*t1[1] + (x[2]-xf[2])*t1[2];
+			    uq[1] = (x[0]-xf[0])*t2[0] + (x[1]-xf[1])*t2[1] + (x[2]-xf[2])*t2[2];
+			    scaledMonomials3(x, xc, diam, val, grad);
+			    scaledMonomials2(uq, fuc, fh, valf, NULL);
+			    double w = triQuadW[q] * tarea;
+			    for(int al = 0; al < np; ++al)
+			    {
+				    Dface[al] += w * val[al];
+				    double gn = grad[3*al]*nrm[0] + grad[3*al+1]*nrm[1] + grad[3*al+2]*nrm[2];
+				    for(int be = 0; be < npf; ++be)
+					    I[al*npf+be] += w * gn * valf[be];
+			    }
+		    }
+
+		    // Tetrahedron (xc, xf, x1, x2)
+		    double e0[3] = {xf[0]-xc[0], xf[1]-xc[1], xf[2]-xc[2]};
+		    double e1[3] = {x1[0]-xc[0], x1[1]-xc[1], x1[2]-xc[2]};
+		    double e2[3] = {x2[0]-xc[0], x2[1]-xc[1], x2[2]-xc[2]};
+		    double tvol = fabs(e0[0]*(e1[1]*e2[2]-e1[2]*e2[1])
+				      - e0[1]*(e1[0]*e2[2]-e1[2]*e2[0])
+				      + e0[2]*(e1[0]*e2[1]-e1[1]*e2[0])) / 6.0;
+		    vol += tvol;
+		    for(int q = 0; q < 4; ++q)
+		    {
+			    double x[3];
+			    for(int d = 0; d < 3; ++d)
+				    x[d] = tetQuadB*(xc[d] + xf[d] + x1[d] + x2[d]) + (tetQuadA - tetQuadB) *
+					    (q == 0 ? xc[d] : q == 1 ? xf[d] : q == 2 ? x1[d] : x2[d]);
+			    scaledMonomials3(x, xc, diam, val, grad);
+			    double w = 0.25 * tvol;
+			    for(int al = 0; al < np; ++al)
+			    {
+				    Dcell[al] += w * val[al];
+				    double kg[3];
+				    for(int d = 0; d < 3; ++d)
+					    kg[d] = Kfull[d][0]*grad[3*al] + Kfull[d][1]*grad[3*al+1] + Kfull[d][2]*grad[3*al+2];
+				    for(int be = 0; be < np; ++be)
+					    GK[al*np+be] += w * (kg[0]*grad[3*be] + kg[1]*grad[3*be+1] + kg[2]*grad[3*be+2]);
+			    }
+		    }
+	    }
+	    for(int al = 0; al < np; ++al)
+		    D[(nn+ne+fid)*np+al] = Dface[al] / qarea;
+
+	    // B(a, face DOF j) += sum_b I(a,b) * Pi_F(b,j)
+	    for(int al = 1; al < np; ++al)
+		    for(int j = 0; j < nfd; ++j)
+		    {
+			    double v = 0.0;
+			    for(int be = 0; be < npf; ++be)
+				    v += I[al*npf+be] * work.FProj[be*nfd+j];
+			    B[al*nd+work.fmap[j]] += v;
+		    }
+    }
+    for(int al = 0; al < np; ++al)
+	    Dcell[al] /= vol;
+    B[nd-1] = 1.0;
+    for(int al = 1; al < np; ++al)
+	    B[al*nd+nd-1] -= monomLaplacian3[al] / (diam*diam) * vol;
+
+    // G = B*D, Proj = G^(-1) * B
+    double Ginv[n_polys_k2*n_polys_k2];
+    for(int a = 0; a < np; ++a)
+	    for(int c = 0; c < np; ++c)
+	    {
+		    Ginv[a*np+c] = 0.0;
+		    for(int i = 0; i < nd; ++i)
+			    Ginv[a*np+c] += B[a*nd+i] * D[i*np+c];
+	    }
+    if(!invertSmallMatrix(Ginv, np))
+    {
+	    std::cerr << "Singular B*D in cell " << cell.GlobalID() << std::endl;
+	    exit(1);
+    }
+    for(int a = 0; a < np; ++a)
+	    for(int i = 0; i < nd; ++i)
+	    {
+		    Proj[a*nd+i] = 0.0;
+		    for(int c = 0; c < np; ++c)
+			    Proj[a*nd+i] += Ginv[a*np+c] * B[c*nd+i];
+	    }
+
+    // Se = I - D*Proj
+    for(int i = 0; i < nd; ++i)
+	    for(int j = 0; j < nd; ++j)
+	    {
+		    double dp = 0.0;
+		    for(int a = 0; a < np; ++a)
+			    dp += D[i*np+a] * Proj[a*nd+j];
+		    Se[i*nd+j] = (i == j ? 1.0 : 0.0) - dp;
+	    }
+
+    for(int a = 0; a < np; ++a)
+	    for(int j = 0; j < nd; ++j)
+	    {
+		    GP[a*nd+j] = 0.0;
+		    for(int c = 0; c < np; ++c)
+			    GP[a*nd+j] += GK[a*np+c] * Proj[c*nd+j];
+	    }
+
+    // W = Proj^T * GK * Proj + stab * Se^T * Se,
+    // stabilization scales as the consistency term, h * |K|
+    double stab = diam * (K[0] + K[1] + K[2]) / 3.0;
+    for(int i = 0; i < nd; ++i)
+	    for(int j = 0; j < nd; ++j)
+	    {
+		    double w = 0.0;
+		    for(int a = 0; a < np; ++a)
+			    w += Proj[a*nd+i] * GP[a*nd+j];
+		    for(int k = 0; k < nd; ++k)
+			    w += stab * Se[k*nd+i] * Se[k*nd+j];
+		    W[i*nd+j] = w;
+	    }
+
+    // Load is tested only with the cell average DOF
+    std::fill(b, b + nd, 0.0);
+    b[nd-1] = exactSolutionRHS(xc) * vol;
 }
 
 void Problem::solveSystem()
@@ -362,12 +1125,12 @@ void Problem::solveSystem()
 
     t = Timer();
     double Cnorm = 0.0;
-    for(Mesh::iteratorNode inode = m.BeginNode(); inode != m.EndNode(); inode++) if(inode->GetStatus() != Element::Ghost && !inode->GetMarker(mrkDirNode))
+    for(Mesh::iteratorElement inode = m.BeginElement(dofTypes); inode != m.EndElement(); inode++) if(inode->GetStatus() != Element::Ghost && !inode->GetMarker(mrkDirNode))
     {
         inode->Real(tagSol) -= sol[var.Index(inode->self())];
         Cnorm = std::max(Cnorm, fabs(inode->Real(tagSol)-inode->Real(tagSolEx)));
     }
-    m.ExchangeData(tagSol, NODE);
+    m.ExchangeData(tagSol, dofTypes);
     Cnorm = m.AggregateMax(Cnorm);
     if(rank == 0) std::cout << "|err|_C = " << Cnorm << std::endl;
     times[T_UPDATE] += Timer() - t;
@@ -381,16 +1144,62 @@ void Problem::saveSolution(std::string prefix)
 	    extension = ".pvtk";
     else
 	    extension = ".vtk";
-    m.Save(prefix + extension);
+    // VEM cache is internal data, not a result
+    Tag skip[] = {tagVemGeom, tagVemG, tagVemProj, tagVemStab};
+    saveWithout(prefix + extension, skip, 4);
+    times[T_IO] += Timer() - t;
+}
+
+// File options of skipped tags are restored after saving,
+// so that they do not affect later saves
+void Problem::saveWithout(std::string path, const Tag *skip, int nskip)
+{
+    std::vector<std::string> prev(nskip);
+    for(int k = 0; k < nskip; ++k)
+    {
+	    std::string opt = "Tag:" + skip[k].GetTagName();
+	    prev[k] = m.GetFileOption(opt);
+	    m.SetFileOption(opt, "nosave");
+    }
+    m.Save(path);
+    for(int k = 0; k < nskip; ++k)
+	    m.SetFileOption("Tag:" + skip[k].GetTagName(), prev[k]);
+}
+
+// Writes INMOST binary parallel file (.pmf), which can be loaded
+// on the same or another number of processes to restart.
+// Only the solution tags are written, the rest is recomputed in initProblem.
+// The ghost layer is removed first, as in files of partition_mesh,
+// so the problem can not be assembled after the checkpoint
+void Problem::saveCheckpoint(std::string prefix)
+{
+    double t = Timer();
+    if(m.GetProcessorsNumber() > 1)
+	    m.RemoveGhost();
+    Tag skip[] = {tagD, tagBC, tagVemGeom, tagVemG, tagVemProj, tagVemStab};
+    saveWithout(prefix + ".pmf", skip, 6);
     times[T_IO] += Timer() - t;
 }
 
 
 int main(int argc, char *argv[])
 {
-    if(argc != 2)
+    // Optional last argument -restart takes the solution from the mesh file
+    bool restart = (argc >= 3 && std::string(argv[argc-1]) == "-restart");
+    int npos = restart ? argc-1 : argc; // number of positional arguments
+    if(npos < 2 || npos > 5)
     {
-        std::cout << "Usage: " << argv[0] << " <mesh_file>" << std::endl;
+        std::cout << "Usage: " << argv[0] << " <mesh_file> [order (1 or 2)] [output (vtk or pmf)] [number of assemblies] [-restart]" << std::endl;
+        return 1;
+    }
+    int order = (npos >= 3) ? atoi(argv[2]) : 1;
+    std::string output = (npos >= 4) ? argv[3] : "vtk";
+    // Repeated assembly and solution, each pass solves for the correction
+    // of the current solution and reuses the VEM cache of the first pass
+    int nassembly = (npos == 5) ? atoi(argv[4]) : 1;
+    if((order != 1 && order != 2) || (output != "vtk" && output != "pmf") || nassembly < 1)
+    {
+        std::cout << "Usage: " << argv[0] << " <mesh_file> [order (1 or 2)] [output (vtk or pmf)] [number of assemblies] [-restart]" << std::endl;
         return 1;
     }
     
@@ -398,11 +1207,17 @@ int main(int argc, char *argv[])
     Mesh::Initialize(&argc, &argv);
     Partitioner::Initialize(&argc, &argv);
 
-    Problem* P = new Problem(argv[1]);
-    P->initProblem();
-    P->assembleGlobalSystem();
-    P->solveSystem();
-    P->saveSolution("res");
+    Problem* P = new Problem(argv[1], order);
+    P->initProblem(restart);
+    for(int k = 0; k < nassembly; ++k)
+    {
+        P->assembleGlobalSystem();
+        P->solveSystem();
+    }
+    if(output == "pmf")
+        P->saveCheckpoint("res");
+    else
+        P->saveSolution("res");
 
     delete P;
 
@@ -0,0 +1,85 @@
+#include "inmost.h"
+
+//    This tool partitions a serial mesh once
+//    and saves it in INMOST parallel format (.pmf),
+//    so that the drivers can load their parts on all ranks directly
+//    instead of loading on rank 0 and partitioning on every run.
+//
+//    Run it on the same number of processes as the solver, e.g.
+//    mpirun -np 64 partition_mesh mesh.vtk mesh64.pmf
+//    mpirun -np 64 3d_diffusion_vem mesh64.pmf
+//
+//    The partition map is stored in the cell tag PARTITION
+//    (rank owning the cell), it is saved along with the mesh.
+//    Ghost cells are not saved, the drivers build them after loading.
+
+
+using namespace INMOST;
+
+const std::string tagNamePartition = "PARTITION";
+
+int main(int argc, char *argv[])
+{
+    if(argc != 3)
+    {
+        std::cout << "Usage: " << argv[0] << " <mesh_file> <output.pmf>" << std::endl;
+        return 1;
+    }
+    std::string out(argv[2]);
+    if(out.size() < 4 || out.substr(out.size()-4) != ".pmf")
+    {
+        std::cout << "Output file should have .pmf extension" << std::endl;
+        return 1;
+    }
+
+    Mesh::Initialize(&argc, &argv);
+    Partitioner::Initialize(&argc, &argv);
+
+    {
+        Mesh m;
+        m.SetCommunicator(INMOST_MPI_COMM_WORLD);
+        int rank = m.GetProcessorRank();
+        double t = Timer();
+
+        if(rank == 0)
+        {
+            m.Load(argv[1]);
+            std::cout << "Number of cells: " << m.NumberOfCells() << std::endl;
+            std::cout << "Number of nodes: " << m.NumberOfNodes() << std::endl;
+        }
+        if(rank == 0) std::cout << "Load: " << Timer() - t << " s" << std::endl;
+
+        t = Timer();
+        if(m.GetProcessorsNumber() > 1)
+        {
+            Partitioner part(&m);
+            part.SetMethod(Partitioner::INNER_KMEANS, Partitioner::Partition);
+            part.Evaluate();
+            m.Redistribute();
+        }
+        m.AssignGlobalID(CELL|FACE|EDGE|NODE);
+        if(rank == 0) std::cout << "Partition: " << Timer() - t << " s" << std::endl;
+
+        Tag tagPart = m.CreateTag(tagNamePartition, DATA_INTEGER, CELL, NONE, 1);
+        for(Mesh::iteratorCell icell = m.BeginCell(); icell != m.EndCell(); icell++)
+            icell->Integer(tagPart) = rank;
+
+        int ncells = m.NumberOfCells(), maxcells = m.AggregateMax(ncells);
+        int total = m.Integrate(ncells);
+        if(rank == 0)
+        {
+            std::cout << "Parts: " << m.GetProcessorsNumber() << std::endl;
+            std::cout << "Cells per part: avg " << total / m.GetProcessorsNumber()
+                      << ", max " << maxcells << std::endl;
+        }
+
+        t = Timer();
+        m.Save(out);
+        if(rank == 0) std::cout << "Save: " << Timer() - t << " s" << std::endl;
+    }
+
+    Partitioner::Finalize();
+    Mesh::Finalize();
+
+    return 0;
+}
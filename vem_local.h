@@ -0,0 +1,100 @@
+#ifndef VEM_LOCAL_H
+#define VEM_LOCAL_H
+
+// Dense local algebra shared by the 2D and 3D VEM drivers
+
+#include <cmath>
+#include <vector>
+#include <algorithm>
+
+// Largest local matrix passed to invertSmallMatrix:
+// number of quadratic monomials in 3D
+const int vem_max_polys = 10;
+
+// In-place inversion of a small dense n x n matrix (n <= vem_max_polys)
+// by Gauss-Jordan elimination with partial pivoting.
+// Returns false if the matrix is singular.
+inline bool invertSmallMatrix(double *A, int n)
+{
+    double inv[vem_max_polys*vem_max_polys];
+    for(int i = 0; i < n; ++i)
+        for(int j = 0; j < n; ++j)
+            inv[i*n+j] = (i == j) ? 1.0 : 0.0;
+
+    for(int k = 0; k < n; ++k)
+    {
+        int p = k;
+        for(int i = k+1; i < n; ++i)
+            if(std::fabs(A[i*n+k]) > std::fabs(A[p*n+k]))
+                p = i;
+        if(A[p*n+k] == 0.0)
+            return false;
+        if(p != k)
+        {
+            for(int j = 0; j < n; ++j)
+            {
+                std::swap(A[p*n+j], A[k*n+j]);
+                std::swap(inv[p*n+j], inv[k*n+j]);
+            }
+        }
+        double piv = 1.0 / A[k*n+k];
+        for(int j = 0; j < n; ++j)
+        {
+            A[k*n+j]   *= piv;
+            inv[k*n+j] *= piv;
+        }
+        for(int i = 0; i < n; ++i) if(i != k && A[i*n+k] != 0.0)
+        {
+            double a = A[i*n+k];
+            for(int j = 0; j < n; ++j)
+            {
+                A[i*n+j]   -= a * A[k*n+j];
+                inv[i*n+j] -= a * inv[k*n+j];
+            }
+        }
+    }
+    std::copy(inv, inv + n*n, A);
+    return true;
+}
+
+// Scratch memory for the local VEM kernels.
+// It is sized once for the cell with the largest number of DOFs
+// and then reused for every cell, so the dense local matrices
+// are not allocated inside the assembly loop. Element lists from
+// INMOST adjacency queries (getNodes, getFaces, ...) still are.
+// Each assembling thread should own its own workspace.
+// The drivers derive from it to add their dimension specific arrays.
+class VemWorkspace
+{
+protected:
+    std::vector<double> buf;
+    // Allocates the common arrays followed by nextra doubles,
+    // returns the start of the extra part
+    double *initCommon(int nd, int np, int nextra)
+    {
+        maxnd = nd;
+        buf.assign(4*np*nd + 2*nd*nd + nd + nextra, 0.0);
+        D    = buf.data();
+        B    = D    + np*nd;
+        Proj = B    + np*nd;
+        GP   = Proj + np*nd;
+        Se   = GP   + np*nd;
+        W    = Se   + nd*nd;
+        b    = W    + nd*nd;
+        return b + nd;
+    }
+public:
+    int maxnd;    // capacity, max number of DOFs per cell
+    double *D;    // nd x np
+    double *B;    // np x nd
+    double *Proj; // np x nd, projector (B*D)^(-1) * B
+    double *GP;   // np x nd, G * Proj
+    double *Se;   // nd x nd, I - D*Proj
+    double *W;    // nd x nd, local stiffness matrix
+    double *b;    // nd, local RHS
+
+    VemWorkspace() : maxnd(0), D(NULL), B(NULL), Proj(NULL),
+        GP(NULL), Se(NULL), W(NULL), b(NULL) {}
+};
+
+#endif // VEM_LOCAL_H